@@ -6,6 +6,11 @@
 #include<functional>
 #include<time.h>
 #include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<limits.h>
+#include<sys/uio.h>
+#include<chrono>
 
 namespace sylar {
 
@@ -31,15 +36,33 @@ const char* LogLevel::ToString(LogLevel::Level level) {
 	return "UNKNOW";
 }
 
-LogEventWrap::LogEventWrap(LogEvent::ptr e)
-	:m_event(e) {
+LogEventWrap::LogEventWrap(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time)
+	:m_event(logger, level, file, line, elapse, thread_id, fiber_id, time) {
 
 }
 LogEventWrap::~LogEventWrap(){
-	m_event->getLogger()->log(m_event->getLevel(), m_event);
+	//别名构造：不拥有m_event，也不分配控制块
+	m_event.getLogger()->log(m_event.getLevel(), LogEvent::ptr(LogEvent::ptr(), &m_event));
+}
+std::ostream& LogEventWrap::getSS(){
+	return m_event.getSS();
 }
-std::stringstream& LogEventWrap::getSS(){
-	return m_event->getSS();
+
+LogStream::LogStream(char* buf, size_t size)
+	:std::ostream(nullptr)
+	,m_buf(buf, size) {
+	rdbuf(&m_buf);//m_buf在基类之后构造，构造完才能交给基类
+}
+
+void LogStream::format(const char* fmt, va_list al){
+	size_t avail = m_buf.avail();
+	//缓冲区末尾预留了'\0'的位置，所以可以写avail+1个字节
+	int len = vsnprintf(const_cast<char*>(m_buf.data()) + m_buf.size(), avail + 1, fmt, al);
+	if (len > 0) {
+		m_buf.commit(std::min((size_t)len, avail));
+	}
 }
 
 
@@ -47,7 +70,7 @@ class MessageFormatItem : public LogFormatter::FormatItem {
 public:
     MessageFormatItem(const std::string& str=""){}
 	void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-		os << event->getContent();
+		os.write(event->getMessage(), event->getMessageSize());
 	}//重写基类中的纯虚函数
 };
 
@@ -101,20 +124,31 @@ class DateTimeFormatItem : public LogFormatter::FormatItem {
 public:
 	DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S") //定义时间格式
 	:m_format(format) {
+		static std::atomic<uint64_t> s_id(0);
+		m_id = ++s_id;
 		if(m_format.empty()){
 			m_format="%Y-%m-%d %H:%M:%S";
 		}
 	}
 	void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-		struct tm tm;
+		//时间以秒为单位，同一秒内的日志直接用上一次格式化的结果
+		static thread_local uint64_t t_id = 0;
+		static thread_local time_t t_time = 0;
+		static thread_local char t_buf[64];
+		static thread_local size_t t_len = 0;
 		time_t time=event->getTime();
-		localtime_r(&time,&tm);
-		char buf[64];
-		strftime(buf,sizeof(buf),m_format.c_str(),&tm);
-		os << buf;
+		if (t_id != m_id || t_time != time) {
+			struct tm tm;
+			localtime_r(&time,&tm);
+			t_len = strftime(t_buf,sizeof(t_buf),m_format.c_str(),&tm);
+			t_id = m_id;
+			t_time = time;
+		}
+		os.write(t_buf, t_len);
 	}
 private:
 	std::string m_format;
+	uint64_t m_id;//区分不同的格式，作为线程局部缓存的键
 };
 
 //获取文件名
@@ -173,6 +207,7 @@ LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
    ,m_threadId(thread_id)
    ,m_fiberId(fiber_id)
    ,m_time(time)
+   ,m_ss(m_message, sizeof(m_message))
    ,m_logger(logger)
    ,m_level(level){
 }
@@ -185,12 +220,7 @@ void LogEvent::format(const char* fmt,...){
 }
 
 void LogEvent::format(const char* fmt,va_list al){
-	char* buf = nullptr;
-	int len = vasprintf(&buf,fmt,al);//分配内存成功则返回长度，失败返回-1
-	if(len!=-1){
-		m_ss << std::string(buf,len);
-		free(buf);
-	}
+	m_ss.format(fmt,al);
 }
 
 
@@ -249,7 +279,7 @@ FileLogAppender::FileLogAppender(const std::string& filename):m_filename(filenam
 
 void FileLogAppender::log(Logger::ptr logger,LogLevel::Level level, LogEvent::ptr event) {
 	if (level >= m_level) {
-		m_filestream << m_formatter->format(logger,level,event);//将文件按照指定格式输出
+		m_formatter->format(m_filestream,logger,level,event);//将文件按照指定格式输出
 	}
 }
 
@@ -263,7 +293,255 @@ bool FileLogAppender::reopen() {
 
 void StdoutLogAppender::log(Logger::ptr logger,LogLevel::Level level, LogEvent::ptr event) {
 	if (level >= m_level) {
-		std::cout << m_formatter->format(logger,level,event);
+		m_formatter->format(std::cout,logger,level,event);
+	}
+}
+
+AsyncLogAppender::Buffer::Buffer(size_t size)
+	:m_data(new char[size])
+	,m_mask(size - 1)
+	,m_head(0)
+	,m_tail(0)
+	,m_closed(false) {
+}
+
+AsyncLogAppender::Buffer::~Buffer() {
+	delete[] m_data;
+}
+
+AsyncLogAppender::AsyncLogAppender(const std::string& filename, OverflowPolicy policy
+			,size_t bufferSize, uint32_t flushIntervalMs)
+	:m_filename(filename)
+	,m_fd(-1)
+	,m_policy(policy)
+	,m_bufferSize(4096)
+	,m_flushIntervalMs(flushIntervalMs ? flushIntervalMs : 1)
+	,m_dropped(0)
+	,m_droppedTotal(0) {
+	static std::atomic<uint64_t> s_id(0);
+	m_id = ++s_id;
+	while (m_bufferSize < bufferSize) {
+		m_bufferSize <<= 1;
+	}//环形缓冲区的容量取2的幂，下标用&代替%
+	if (!reopen()) {
+		std::cout << "AsyncLogAppender open error: " << m_filename << std::endl;
+	}
+	m_thread = std::thread(&AsyncLogAppender::run, this);
+}
+
+AsyncLogAppender::~AsyncLogAppender() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeup.notify_one();
+	m_thread.join();//后台线程退出之前会再写一次
+	for (auto& i : m_buffers) {
+		i->m_closed = true;
+	}//线程局部的记录看到m_closed就会释放缓冲区
+	if (m_fd != -1) {
+		close(m_fd);
+	}
+}
+
+void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+	if (level >= m_level) {
+		//格式化到线程局部的缓冲区，再整条拷进环形缓冲区
+		static thread_local char t_buf[RECORD_SIZE];
+		static thread_local LogStream t_record(t_buf, sizeof(t_buf));
+		t_record.reset();
+		m_formatter->format(t_record, logger, level, event);
+		append(getBuffer(), level, t_record.data(), t_record.size());
+		if (level >= LogLevel::FATAL) {
+			flush();//FATAL之后进程通常马上退出，必须等它落到文件里
+		}
+	}
+}
+
+AsyncLogAppender::Buffer& AsyncLogAppender::getBuffer() {
+	//每个线程记录自己在各个AsyncLogAppender中的缓冲区，线程退出时通知后台线程回收
+	struct ThreadBuffers {
+		~ThreadBuffers() {
+			for (auto& i : m_items) {
+				i.second->m_closed = true;
+			}
+		}
+		std::vector<std::pair<uint64_t, Buffer::ptr>> m_items;
+	};
+	static thread_local ThreadBuffers t_buffers;
+
+	auto& items = t_buffers.m_items;
+	for (auto it = items.begin(); it != items.end();) {
+		if (it->first == m_id) {
+			return *it->second;
+		}
+		if (it->second->m_closed) {
+			it = items.erase(it);//对应的AsyncLogAppender已经销毁
+		}
+		else {
+			++it;
+		}
+	}
+	Buffer::ptr buf(new Buffer(m_bufferSize));
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_buffers.push_back(buf);
+	}
+	items.push_back(std::make_pair(m_id, buf));
+	return *buf;
+}
+
+bool AsyncLogAppender::append(Buffer& buf, LogLevel::Level level, const char* data, size_t len) {
+	size_t capacity = buf.m_mask + 1;
+	len = std::min(len, capacity);//超过整个缓冲区的日志截断
+	size_t head = buf.m_head.load(std::memory_order_relaxed);
+	size_t used = head - buf.m_tail.load(std::memory_order_acquire);
+
+	if (m_policy == SAMPLE && level < LogLevel::ERROR && used > capacity / 2
+			&& buf.m_sampled++ % m_sampleRate != 0) {
+		++m_dropped;
+		++m_droppedTotal;
+		return false;
+	}
+	while (capacity - used < len) {
+		//FATAL不管哪种策略都要等
+		if (m_policy != BLOCK && level < LogLevel::FATAL) {
+			++m_dropped;
+			++m_droppedTotal;
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wakeup.notify_one();
+		used = head - buf.m_tail.load(std::memory_order_acquire);
+		if (capacity - used < len) {
+			m_drained.wait_for(lock, std::chrono::milliseconds(m_flushIntervalMs));
+			used = head - buf.m_tail.load(std::memory_order_acquire);
+		}
+	}
+
+	size_t offset = head & buf.m_mask;
+	size_t first = std::min(len, capacity - offset);
+	memcpy(buf.m_data + offset, data, first);
+	memcpy(buf.m_data, data + first, len - first);
+	buf.m_head.store(head + len, std::memory_order_release);
+
+	//超过一半时提前唤醒后台线程，只在越过一半的那一次唤醒
+	if (used <= capacity / 2 && used + len > capacity / 2) {
+		m_wakeup.notify_one();
+	}
+	return true;
+}
+
+void AsyncLogAppender::flush() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	uint64_t ticket = ++m_flushRequested;
+	m_wakeup.notify_one();
+	m_drained.wait(lock, [this, ticket] { return m_flushDone >= ticket; });
+}
+
+bool AsyncLogAppender::reopen() {
+	int fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+	int old = m_fd;
+	if (old == -1) {
+		m_fd = fd;
+	}
+	else {
+		dup2(fd, old);//原子地替换，后台线程不会写到已关闭的fd上
+		close(fd);
+	}
+	return true;
+}
+
+void AsyncLogAppender::run() {
+	std::vector<Buffer::ptr> buffers;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		if (!m_stop && m_flushRequested == m_flushDone) {
+			m_wakeup.wait_for(lock, std::chrono::milliseconds(m_flushIntervalMs));
+		}
+		bool stop = m_stop;
+		uint64_t requested = m_flushRequested;//在这之前追加的日志本轮都会写出
+		buffers = m_buffers;
+		lock.unlock();
+
+		drain(buffers);
+
+		lock.lock();
+		m_flushDone = requested;
+		//回收已退出线程的空缓冲区
+		for (auto it = m_buffers.begin(); it != m_buffers.end();) {
+			if ((*it)->m_closed && (*it)->m_head == (*it)->m_tail) {
+				it = m_buffers.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		m_drained.notify_all();
+		if (stop) {
+			break;
+		}
+	}
+}
+
+//writev写完iov中的全部数据，出错时放弃剩余部分
+static void WriteAll(int fd, struct iovec* iov, int cnt) {
+	while (cnt > 0) {
+		ssize_t n = writev(fd, iov, std::min(cnt, IOV_MAX));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+void AsyncLogAppender::drain(const std::vector<Buffer::ptr>& buffers) {
+	std::vector<struct iovec> iov;
+	std::vector<size_t> heads;
+	iov.reserve(buffers.size() * 2 + 1);
+	heads.reserve(buffers.size());
+	//每个缓冲区的数据最多分成两段（绕回开头），所有线程的数据一次writev
+	for (auto& buf : buffers) {
+		size_t head = buf->m_head.load(std::memory_order_acquire);
+		size_t tail = buf->m_tail.load(std::memory_order_relaxed);
+		heads.push_back(head);
+		if (head == tail) {
+			continue;
+		}
+		size_t capacity = buf->m_mask + 1;
+		size_t offset = tail & buf->m_mask;
+		size_t len = head - tail;
+		size_t first = std::min(len, capacity - offset);
+		iov.push_back({buf->m_data + offset, first});
+		if (len > first) {
+			iov.push_back({buf->m_data, len - first});
+		}
+	}
+	char note[64];
+	uint64_t dropped = m_dropped.exchange(0);
+	if (dropped) {
+		int n = snprintf(note, sizeof(note), "AsyncLogAppender dropped %lu records\n", (unsigned long)dropped);
+		iov.push_back({note, (size_t)n});
+	}
+	if (!iov.empty() && m_fd != -1) {
+		WriteAll(m_fd, &iov[0], iov.size());
+	}
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		buffers[i]->m_tail.store(heads[i], std::memory_order_release);
 	}
 }
 
@@ -273,10 +551,14 @@ LogFormatter::LogFormatter(const std::string& pattern):m_pattern(pattern) {
 
 std::string LogFormatter::format(std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) {
 	std::stringstream ss;
+	format(ss, logger, level, event);
+	return ss.str();//str()函数用于将stringstream流中的数据以string字符串的形式输出
+}
+
+void LogFormatter::format(std::ostream& os,std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) {
 	for (auto& i : m_items) {
-		i->format(ss, logger,level,event);
+		i->format(os, logger,level,event);
 	}
-	return ss.str();//str()函数用于将stringstream流中的数据以string字符串的形式输出
 }
 
 void LogFormatter::init() {
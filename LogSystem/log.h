@@ -11,15 +11,20 @@
 #include<vector>
 #include<stdarg.h>
 #include<map>
+#include<atomic>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
 #include "util.h"
 #include "singleton.h"
 
 //流式的宏定义（带参数的宏定义）
+//LogEvent是LogEventWrap临时对象的成员，在栈上构造，整条语句结束时析构并输出，不分配内存
 #define SYLAR_LOG_LEVEL(logger,level) \
 	if(logger->getLevel() <= level) \
-		sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger,level, \
+		sylar::LogEventWrap(logger,level, \
 			__FILE__,__LINE__,0,sylar::GetThreadId(),\
-			sylar::GetFiberId(),time(0)))).getSS()
+			sylar::GetFiberId(),time(0)).getSS()
 
 #define SYLAR_LOG_DEBUG(logger) SYLAR_LOG_LEVEL(logger,sylar::LogLevel::DEBUG)
 #define SYLAR_LOG_INFO(logger) SYLAR_LOG_LEVEL(logger,sylar::LogLevel::INFO)
@@ -29,9 +34,9 @@
 
 #define SYLAR_LOG_FMT_LEVEL(logger, level, fmt, ...)\
 	if(logger->getLevel() <= level) \
-		sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, \
+		sylar::LogEventWrap(logger, level, \
 						__FILE__, __LINE__, 0, sylar::GetThreadId(), \
-				sylar::GetFiberId(), time(0)))).getEvent()->format(fmt, __VA_ARGS__)
+				sylar::GetFiberId(), time(0)).getEvent()->format(fmt, __VA_ARGS__)
 
 #define SYLAR_LOG_FMT_DEBUG(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger,sylar::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define SYLAR_LOG_FMT_INFO(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger,sylar::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -58,10 +63,35 @@ public:
 	static const char* ToString(LogLevel::Level level);
 };
 
+//输出到定长缓冲区的流，写满之后截断，不分配内存
+class LogStream : public std::ostream {
+public:
+	LogStream(char* buf, size_t size);//size包括结尾'\0'的位置
+
+	const char* data() const { return m_buf.data(); }
+	size_t size() const { return m_buf.size(); }
+	void reset() { m_buf.reset(); clear(); }//清空内容，重复使用同一个缓冲区
+	void format(const char* fmt, va_list al);//vsnprintf直接写到缓冲区
+private:
+	class Buf : public std::streambuf {
+	public:
+		Buf(char* buf, size_t size) { setp(buf, buf + size - 1); }
+		const char* data() const { return pbase(); }
+		size_t size() const { return pptr() - pbase(); }
+		size_t avail() const { return epptr() - pptr(); }
+		void commit(size_t n) { pbump((int)n); }
+		void reset() { setp(pbase(), epptr()); }
+	};
+	Buf m_buf;
+};
+
 //日志事件
+//宏在栈上构造LogEvent，交给Appender的LogEvent::ptr不拥有它（没有控制块），Appender不能在log返回之后保存
 class LogEvent {
 public:
 	typedef std::shared_ptr<LogEvent> ptr;//智能指针用来自动正确的销毁动态分配的对象
+	static const size_t MESSAGE_SIZE = 1024;//消息内容的上限，超过的部分截断
+
 	LogEvent(std::shared_ptr<Logger> logger,LogLevel::Level level, const char* file,int32_t m_line
 		,uint32_t elapse,uint32_t thread_id,uint32_t fiber_id, uint64_t time);
 
@@ -71,11 +101,13 @@ public:
 	uint32_t getThreadId() const { return m_threadId; }
 	uint32_t getFiberId() const { return m_fiberId; }
 	uint64_t getTime() const { return m_time; }
-	std::string getContent() const { return m_ss.str(); }
+	std::string getContent() const { return std::string(m_ss.data(), m_ss.size()); }
+	const char* getMessage() const { return m_ss.data(); }//消息内容，不以'\0'结尾
+	size_t getMessageSize() const { return m_ss.size(); }
 	std::shared_ptr<Logger> getLogger() const {return m_logger;}
 	LogLevel::Level getLevel() const {return m_level;}
 
-    std::stringstream& getSS(){ return m_ss;}
+    std::ostream& getSS(){ return m_ss;}
 	void format(const char* fmt, ...);
 	void format(const char* fmt,va_list al);
 
@@ -86,20 +118,23 @@ private:
 	uint32_t m_threadId = 0;     //线程ID
 	uint32_t m_fiberId = 0;      //协程ID
 	uint64_t m_time = 0;             //时间戳
-	std::stringstream m_ss;       //消息内容
+	char m_message[MESSAGE_SIZE];    //消息内容的缓冲区
+	LogStream m_ss;                  //写入m_message
 
 	std::shared_ptr<Logger> m_logger;
 	LogLevel::Level m_level;
 };
 
+//包含一个LogEvent，析构时交给Logger输出
 class LogEventWrap{
 public:
-	LogEventWrap(LogEvent::ptr e);
+	LogEventWrap(std::shared_ptr<Logger> logger,LogLevel::Level level, const char* file,int32_t line
+		,uint32_t elapse,uint32_t thread_id,uint32_t fiber_id, uint64_t time);
 	~LogEventWrap();
-	LogEvent::ptr getEvent() const { return m_event;}
-	std::stringstream& getSS();
+	LogEvent* getEvent() { return &m_event;}
+	std::ostream& getSS();
 private:
-	LogEvent::ptr m_event;
+	LogEvent m_event;
 };
 
 
@@ -111,6 +146,8 @@ public:
 	LogFormatter(const std::string& pattern);//根据pattern格式解析出不同Item
 
 	std::string format(std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event );
+	//直接输出到os（文件流、Appender的缓冲区），不生成中间的字符串
+	void format(std::ostream& os,std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event );
 public:
 	//用于解析类别的抽象类
 	class FormatItem {
@@ -171,7 +208,7 @@ public:
 	LogLevel::Level getLevel() const { return m_level; }
 	void setLevel(LogLevel::Level val) { m_level = val; }
 
-	const std::string getName() const { return m_name; }
+	const std::string& getName() const { return m_name; }
 
 
 private:
@@ -201,6 +238,76 @@ private:
 	std::ofstream m_filestream;
 };
 
+//异步输出到文件的Appender
+//调用线程只负责格式化，把格式化好的日志追加到本线程的环形缓冲区（单生产者单消费者，无锁），
+//后台线程周期性地把所有线程的缓冲区一次writev到文件，日志不再在业务线程上做文件I/O
+//每个线程的缓冲区大小固定，内存上限是 线程数*bufferSize；缓冲区满时按OverflowPolicy处理
+//FATAL级别的日志返回之前保证已经写入文件
+class AsyncLogAppender :public LogAppender {
+public:
+	typedef std::shared_ptr<AsyncLogAppender> ptr;
+	//缓冲区满时的处理方式
+	enum OverflowPolicy {
+		BLOCK = 0,  //等待后台线程腾出空间，不丢日志
+		DROP = 1,   //丢弃这条日志
+		SAMPLE = 2  //缓冲区超过一半时，ERROR以下的日志每sampleRate条只保留1条，满了丢弃
+	};
+
+	//bufferSize是每个线程的缓冲区大小，向上取整为2的幂；flushIntervalMs是后台线程的最长写入间隔
+	AsyncLogAppender(const std::string& filename, OverflowPolicy policy = BLOCK
+		,size_t bufferSize = 1 << 20, uint32_t flushIntervalMs = 100);
+	~AsyncLogAppender();//写完所有缓冲区之后退出后台线程
+
+	void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+	void flush();//阻塞到调用之前追加的日志都已写入文件
+	bool reopen();//重新打开文件，文件打开成功返回true
+
+	void setSampleRate(uint32_t val) { m_sampleRate = val ? val : 1; }
+	uint64_t getDropped() const { return m_droppedTotal; }//因缓冲区满丢弃的日志条数
+private:
+	//一个线程的环形缓冲区，m_head只由所属线程推进，m_tail只由后台线程推进
+	struct Buffer {
+		typedef std::shared_ptr<Buffer> ptr;
+		Buffer(size_t size);
+		~Buffer();
+
+		char* m_data;
+		size_t m_mask;                   //容量-1
+		std::atomic<size_t> m_head;      //已写入的总字节数
+		std::atomic<size_t> m_tail;      //已输出的总字节数
+		std::atomic<bool> m_closed;      //所属线程已退出，取空之后可以回收
+		uint32_t m_sampled = 0;          //SAMPLE策略的计数，只由所属线程访问
+	};
+
+	static const size_t RECORD_SIZE = LogEvent::MESSAGE_SIZE + 1024;//格式化之后一条日志的上限
+
+	Buffer& getBuffer();//本线程的缓冲区，第一次调用时创建并登记
+	bool append(Buffer& buf, LogLevel::Level level, const char* data, size_t len);
+	void run();//后台线程
+	void drain(const std::vector<Buffer::ptr>& buffers);//把缓冲区中的数据写入文件
+
+	std::string m_filename;
+	std::atomic<int> m_fd;                //reopen时可能和后台线程的写入并发
+	OverflowPolicy m_policy;
+	size_t m_bufferSize;
+	uint32_t m_flushIntervalMs;
+	uint32_t m_sampleRate = 8;
+	uint64_t m_id;                        //区分不同的AsyncLogAppender，作为线程局部缓冲区的键
+
+	std::mutex m_mutex;                   //保护下面的成员
+	std::vector<Buffer::ptr> m_buffers;   //所有线程的缓冲区
+	std::condition_variable m_wakeup;     //唤醒后台线程
+	std::condition_variable m_drained;    //后台线程写完一批，等待空间或者flush的线程检查条件
+	uint64_t m_flushRequested = 0;
+	uint64_t m_flushDone = 0;
+	bool m_stop = false;
+
+	std::atomic<uint64_t> m_dropped;      //还没有报告的丢弃条数
+	std::atomic<uint64_t> m_droppedTotal;
+	std::thread m_thread;
+};
+
 //日志管理器
 class LoggerManager{
 public:
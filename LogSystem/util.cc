@@ -3,7 +3,9 @@
 namespace sylar{
 
 pid_t GetThreadId(){
-    return syscall(SYS_gettid);
+    //每条日志都要取线程号，只在线程第一次调用时进行系统调用
+    static thread_local pid_t t_tid = syscall(SYS_gettid);
+    return t_tid;
 }
 
 uint32_t GetFiberId(){
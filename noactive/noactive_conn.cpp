@@ -6,21 +6,12 @@
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 64
-class util_timer;   // 前向声明
+struct client_data;   // 前向声明
 
-// 用户数据结构
-struct client_data
-{
-    sockaddr_in address;    // 客户端socket地址
-    int sockfd;             // socket文件描述符
-    char buf[ BUFFER_SIZE ];    // 读缓存
-    util_timer* timer;          // 定时器
-};
-
-// 定时器类
+// 定时器类，作为client_data的成员，链表只负责把它串起来，添加、删除、到期都不分配和释放内存
 class util_timer {
 public:
-    util_timer() : prev(NULL), next(NULL){}
+    util_timer() : expire( 0 ), cb_func( NULL ), user_data( NULL ), prev( NULL ), next( NULL ) {}
 
 public:
    time_t expire;   // 任务超时时间，这里使用绝对时间
@@ -30,25 +21,40 @@ public:
    util_timer* next;    // 指向后一个定时器
 };
 
+// 用户数据结构
+struct client_data
+{
+    sockaddr_in address;    // 客户端socket地址
+    int sockfd;             // socket文件描述符
+    char buf[ BUFFER_SIZE ];    // 读缓存
+    util_timer timer;           // 定时器
+};
+
 // 定时器链表，它是一个升序、双向链表，且带有头节点和尾节点。
 class sort_timer_lst {
 public:
     sort_timer_lst() : head( NULL ), tail( NULL ) {}
-    // 链表被销毁时，删除其中所有的定时器
+    // 链表不拥有定时器，销毁时只把其中所有的定时器摘下来
     ~sort_timer_lst() {
         util_timer* tmp = head;
         while( tmp ) {
             head = tmp->next;
-            delete tmp;
+            tmp->prev = tmp->next = NULL;
             tmp = head;
         }
     }
+
+    // 定时器是否在链表中
+    bool pending( util_timer* timer ) const {
+        return timer == head || timer->prev != NULL;
+    }
     
     // 将目标定时器timer添加到链表中
     void add_timer( util_timer* timer ) {
         if( !timer ) {
             return;
         }
+        timer->prev = timer->next = NULL;
         if( !head ) {
             head = tail = timer;
             return; 
@@ -89,39 +95,35 @@ public:
             add_timer( timer, timer->next );
         }
     }
-    // 将目标定时器 timer 从链表中删除
+    // 将目标定时器 timer 从链表中摘下，定时器是client_data的成员，不需要释放，不在链表中时什么也不做
     void del_timer( util_timer* timer )
     {
-        if( !timer ) {
+        if( !timer || !pending( timer ) ) {
             return;
         }
         // 下面这个条件成立表示链表中只有一个定时器，即目标定时器
         if( ( timer == head ) && ( timer == tail ) ) {
-            delete timer;
             head = NULL;
             tail = NULL;
-            return;
         }
         /* 如果链表中至少有两个定时器，且目标定时器是链表的头节点，
-         则将链表的头节点重置为原头节点的下一个节点，然后删除目标定时器。 */
-        if( timer == head ) {
+         则将链表的头节点重置为原头节点的下一个节点。 */
+        else if( timer == head ) {
             head = head->next;
             head->prev = NULL;
-            delete timer;
-            return;
         }
         /* 如果链表中至少有两个定时器，且目标定时器是链表的尾节点，
-        则将链表的尾节点重置为原尾节点的前一个节点，然后删除目标定时器。*/
-        if( timer == tail ) {
+        则将链表的尾节点重置为原尾节点的前一个节点。*/
+        else if( timer == tail ) {
             tail = tail->prev;
             tail->next = NULL;
-            delete timer;
-            return;
         }
-        // 如果目标定时器位于链表的中间，则把它前后的定时器串联起来，然后删除目标定时器
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        delete timer;
+        // 如果目标定时器位于链表的中间，则把它前后的定时器串联起来
+        else {
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+        }
+        timer->prev = timer->next = NULL;
     }
 
     /* SIGALARM 信号每次被触发就在其信号处理函数中执行一次 tick() 函数，以处理链表上到期任务。*/
@@ -140,14 +142,17 @@ public:
                 break;
             }
 
-            // 调用定时器的回调函数，以执行定时任务
-            tmp->cb_func( tmp->user_data );
-            // 执行完定时器中的定时任务之后，就将它从链表中删除，并重置链表头节点
+            // 先把定时器从链表中摘下，并重置链表头节点，回调函数中可以重新添加它，或者让它所在的client_data失效
             head = tmp->next;
             if( head ) {
                 head->prev = NULL;
             }
-            delete tmp;
+            else {
+                tail = NULL;
+            }
+            tmp->prev = tmp->next = NULL;
+            // 调用定时器的回调函数，以执行定时任务
+            tmp->cb_func( tmp->user_data );
             tmp = head;
         }
     }
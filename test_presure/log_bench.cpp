@@ -0,0 +1,90 @@
+/*
+    sylar日志系统的性能测试，统计每条日志平均的纳秒数和调用线程上的内存分配次数
+    - stream：SYLAR_LOG_INFO(logger) << ...
+    - fmt：SYLAR_LOG_FMT_INFO(logger, ...)
+    - level：级别不够、被宏过滤掉的日志
+    输出地分别是写到/dev/null的FileLogAppender和AsyncLogAppender，格式是Logger的默认格式
+    分配次数通过替换全局的operator new统计，只统计调用线程，AsyncLogAppender后台线程的分配不算在内
+
+    编译： g++ -std=c++11 -O2 log_bench.cpp ../LogSystem/log.cc ../LogSystem/util.cc -I../LogSystem -o log_bench -pthread
+    运行： ./log_bench [每项测量的日志条数，默认200000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+#include "log.h"
+
+static thread_local uint64_t t_allocs = 0;
+
+void* operator new(size_t size) {
+    ++t_allocs;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// 不能内联：内联之后编译器看到operator new返回的指针被free，会报-Wmismatched-new-delete
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+// C++14起delete表达式调用带大小的版本，同样替换
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* appender, const char* name, int n, double start, uint64_t allocs) {
+    printf("%-6s %-7s %8.1f ns/line %6.2f allocs/line\n", appender, name,
+           (now_ns() - start) / n, (double) allocs / n);
+}
+
+static void run(const char* appender, sylar::LogAppender::ptr out, int n) {
+    sylar::Logger::ptr logger(new sylar::Logger("bench"));
+    logger->addAppender(out);
+    logger->setLevel(sylar::LogLevel::INFO);
+
+    // 预热：创建线程局部的缓冲区等只发生一次的分配
+    for (int i = 0; i < 1000; ++i) {
+        SYLAR_LOG_INFO(logger) << "warm up " << i;
+    }
+
+    uint64_t allocs = t_allocs;
+    double start = now_ns();
+    for (int i = 0; i < n; ++i) {
+        SYLAR_LOG_INFO(logger) << "GET /index.html fd=" << i << " status=" << 200 << " bytes=" << 1024;
+    }
+    report(appender, "stream", n, start, t_allocs - allocs);
+
+    allocs = t_allocs;
+    start = now_ns();
+    for (int i = 0; i < n; ++i) {
+        SYLAR_LOG_FMT_INFO(logger, "GET /index.html fd=%d status=%d bytes=%d", i, 200, 1024);
+    }
+    report(appender, "fmt", n, start, t_allocs - allocs);
+
+    allocs = t_allocs;
+    start = now_ns();
+    for (int i = 0; i < n; ++i) {
+        SYLAR_LOG_DEBUG(logger) << "filtered " << i;
+    }
+    report(appender, "level", n, start, t_allocs - allocs);
+}
+
+int main(int argc, char* argv[]) {
+    int n = 200000;
+    if (argc > 1) {
+        n = atoi(argv[1]);
+    }
+    run("file", sylar::LogAppender::ptr(new sylar::FileLogAppender("/dev/null")), n);
+    run("async", sylar::LogAppender::ptr(new sylar::AsyncLogAppender("/dev/null")), n);
+    return 0;
+}
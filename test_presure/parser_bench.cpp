@@ -0,0 +1,273 @@
+/*
+    HTTP请求解析的性能测试，比较原来逐字节扫描+strpbrk+逐个strncasecmp的解析方式
+    和http_parser（AVX2 / SSE4.2 / 逐字节 三种实现）的解析方式，统计每个请求平均的CPU周期数
+    语料是常见客户端（curl、wrk、Chrome、Firefox、爬虫）实际发出的请求，解析逻辑和http_conn中的一样：
+    找行尾、拆请求行、取出Connection / Content-Length / Host字段
+
+    编译： g++ -std=c++11 -O2 parser_bench.cpp ../webserver/http_parser.cpp -o parser_bench
+    运行： ./parser_bench [每种请求的解析次数，默认200000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <x86intrin.h>
+#include "../webserver/http_parser.h"
+
+static const char *corpus[] = {
+    // curl
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/7.81.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    // wrk
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+    // Chrome
+    "GET /images/banner.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1697000000; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "If-None-Match: \"65a1-5f2b3c4d\"\r\n"
+    "If-Modified-Since: Mon, 16 Oct 2023 08:12:45 GMT\r\n"
+    "\r\n",
+    // Firefox
+    "GET /static/js/app.min.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n",
+    // 爬虫
+    "GET http://www.example.com/robots.txt HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)\r\n"
+    "Accept: text/plain,text/html;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "From: googlebot(at)googlebot.com\r\n"
+    "\r\n",
+};
+
+struct result {
+    const char *url;
+    const char *host;
+    long content_length;
+    bool linger;
+};
+
+// 原来的解析方式：逐字节找\r\n，strpbrk拆请求行，依次strncasecmp比较字段名
+static int old_parse_line(char *buf, int &checked, int read_idx) {
+    for (; checked < read_idx; ++checked) {
+        char temp = buf[checked];
+        if (temp == '\r') {
+            if (checked + 1 == read_idx) {
+                return 1;
+            }
+            else if (buf[checked + 1] == '\n') {
+                buf[checked++] = '\0';
+                buf[checked++] = '\0';
+                return 0;
+            }
+            return 2;
+        }
+        else if (temp == '\n') {
+            return 2;
+        }
+    }
+    return 1;
+}
+
+static bool old_parse(char *buf, int len, result &res) {
+    int checked = 0, start = 0;
+    bool request_line = true;
+    while (old_parse_line(buf, checked, len) == 0) {
+        char *text = buf + start;
+        start = checked;
+        if (request_line) {
+            char *url = strpbrk(text, " \t");
+            if (!url) {
+                return false;
+            }
+            *url++ = '\0';
+            if (strcasecmp(text, "GET") != 0) {
+                return false;
+            }
+            char *version = strpbrk(url, " \t");
+            if (!version) {
+                return false;
+            }
+            *version++ = '\0';
+            if (strcasecmp(version, "HTTP/1.1") != 0) {
+                return false;
+            }
+            if (strncasecmp(url, "http://", 7) == 0) {
+                url = strchr(url + 7, '/');
+            }
+            res.url = url;
+            request_line = false;
+        }
+        else if (text[0] == '\0') {
+            return true;
+        }
+        else if (strncasecmp(text, "Connection:", 11) == 0) {
+            text += 11;
+            text += strspn(text, " \t");
+            res.linger = strcasecmp(text, "keep-alive") == 0;
+        }
+        else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+            text += 15;
+            text += strspn(text, " \t");
+            res.content_length = atol(text);
+        }
+        else if (strncasecmp(text, "Host:", 5) == 0) {
+            text += 5;
+            text += strspn(text, " \t");
+            res.host = text;
+        }
+    }
+    return false;
+}
+
+// 现在的解析方式，和http_conn::parse_line / parse_request_line / parse_headers一致
+static int new_parse_line(char *buf, int &checked, int read_idx) {
+    const char *end = buf + read_idx;
+    checked = http_parser::find_line_end(buf + checked, end) - buf;
+    if (checked >= read_idx) {
+        return 1;
+    }
+    if (buf[checked] == '\r') {
+        if (checked + 1 == read_idx) {
+            return 1;
+        }
+        else if (buf[checked + 1] == '\n') {
+            buf[checked++] = '\0';
+            buf[checked++] = '\0';
+            return 0;
+        }
+    }
+    return 2;
+}
+
+static bool new_parse(char *buf, int len, result &res) {
+    int checked = 0, start = 0;
+    bool request_line = true;
+    while (new_parse_line(buf, checked, len) == 0) {
+        char *text = buf + start;
+        const char *end = buf + checked;
+        start = checked;
+        if (request_line) {
+            char *url = (char *) http_parser::find_char2(text, end, ' ', '\t');
+            if (url == end || url - text != 3 || strncasecmp(text, "GET", 3) != 0) {
+                return false;
+            }
+            *url++ = '\0';
+            char *version = (char *) http_parser::find_char2(url, end, ' ', '\t');
+            if (version == end) {
+                return false;
+            }
+            *version++ = '\0';
+            if (strcasecmp(version, "HTTP/1.1") != 0) {
+                return false;
+            }
+            if (strncasecmp(url, "http://", 7) == 0) {
+                url = strchr(url + 7, '/');
+            }
+            res.url = url;
+            request_line = false;
+            continue;
+        }
+        if (text[0] == '\0') {
+            return true;
+        }
+        char *colon = (char *) http_parser::find_char2(text, end, ':', '\0');
+        if (*colon != ':') {
+            continue;
+        }
+        char *value = colon + 1;
+        value += strspn(value, " \t");
+        switch (http_parser::lookup_header(text, colon - text)) {
+            case http_parser::HEADER_CONNECTION :
+                res.linger = strcasecmp(value, "keep-alive") == 0;
+                break;
+            case http_parser::HEADER_CONTENT_LENGTH :
+                res.content_length = atol(value);
+                break;
+            case http_parser::HEADER_HOST :
+                res.host = value;
+                break;
+            default :
+                break;
+        }
+    }
+    return false;
+}
+
+typedef bool (*parse_func)(char *, int, result &);
+
+// 每次解析前把原始请求复制到缓冲区（解析会写入'\0'），复制的开销两种方式相同
+static double bench(parse_func parse, const char *req, int len, long rounds, result &res) {
+    char buf[4096];
+    unsigned long long begin = __rdtsc();
+    for (long i = 0; i < rounds; ++i) {
+        memcpy(buf, req, len);
+        memset(&res, 0, sizeof(res));
+        if (!parse(buf, len, res)) {
+            printf("parse failed\n");
+            exit(1);
+        }
+        __asm__ __volatile__("" : : "r"(&res) : "memory");
+    }
+    return (double)(__rdtsc() - begin) / rounds;
+}
+
+int main(int argc, char *argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    static const char *names[] = {"curl", "wrk", "chrome", "firefox", "bot"};
+    const int count = sizeof(corpus) / sizeof(corpus[0]);
+
+    http_parser::SIMD_LEVEL best = http_parser::level();
+    printf("CPU支持的最高级别: %s，每种请求解析%ld次，单位: 周期/请求\n", http_parser::level_name(best), rounds);
+    printf("%-8s %6s %10s %10s %10s %10s\n", "请求", "字节", "原来", "scalar", "sse4.2", "avx2");
+
+    for (int i = 0; i < count; ++i) {
+        int len = strlen(corpus[i]);
+        result old_res, new_res;
+        double old_cycles = bench(old_parse, corpus[i], len, rounds, old_res);
+        printf("%-8s %6d %10.0f", names[i], len, old_cycles);
+
+        for (int level = http_parser::SIMD_SCALAR; level <= http_parser::SIMD_AVX2; ++level) {
+            if (level > best) {
+                printf(" %10s", "-");
+                continue;
+            }
+            http_parser::set_level((http_parser::SIMD_LEVEL) level);
+            double cycles = bench(new_parse, corpus[i], len, rounds, new_res);
+            printf(" %10.0f", cycles);
+        }
+        printf("\n");
+        http_parser::set_level(best);
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+    线程池请求队列的压力测试，比较 互斥锁+信号量+链表（locked_queue）、无锁环形队列（mpmc_queue）
+    和工作窃取队列（stealing_queue）
+    P个生产者线程不停地放入请求（队列满了就重试），P个消费者线程取出请求，统计每秒处理的请求数
+    第i个生产者把请求指定给第i个消费者，只有工作窃取队列会用到这个指定
+
+    编译： g++ -std=c++11 -O2 queue_bench.cpp -o queue_bench -lpthread
+    运行： ./queue_bench [每轮的请求总数，默认2000000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <atomic>
+#include "../webserver/request_queue.h"
+
+struct task {
+    int id;
+};
+
+template<typename Queue>
+struct bench_ctx;
+
+// 每个线程的参数
+template<typename Queue>
+struct bench_thread {
+    bench_ctx<Queue> *ctx;
+    int id;
+};
+
+template<typename Queue>
+struct bench_ctx {
+    Queue *queue;
+    int threads; // 生产者和消费者各自的线程数
+    long per_producer; // 每个生产者放入的请求数
+    long total; // 请求总数
+    std::atomic<long> consumed;
+    task item;
+};
+
+template<typename Queue>
+void *producer(void *arg) {
+    bench_thread<Queue> *self = (bench_thread<Queue> *) arg;
+    bench_ctx<Queue> *ctx = self->ctx;
+    for (long i = 0; i < ctx->per_producer; ++i) {
+        while (!ctx->queue->push(&ctx->item, self->id)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template<typename Queue>
+void *consumer(void *arg) {
+    bench_thread<Queue> *self = (bench_thread<Queue> *) arg;
+    bench_ctx<Queue> *ctx = self->ctx;
+    while (1) {
+        task *t = ctx->queue->pop(self->id);
+        if (!t) {
+            // 所有请求都处理完了
+            break;
+        }
+        if (++ctx->consumed == ctx->total) {
+            ctx->queue->stop();
+        }
+    }
+    return NULL;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 返回每秒处理的请求数
+template<typename Queue>
+double run_bench(int threads, long total) {
+    bench_ctx<Queue> ctx;
+    ctx.queue = new Queue(10000, threads);
+    ctx.threads = threads;
+    ctx.per_producer = total / threads;
+    ctx.total = ctx.per_producer * threads;
+    ctx.consumed = 0;
+
+    pthread_t *tids = new pthread_t[threads * 2];
+    bench_thread<Queue> *args = new bench_thread<Queue>[threads];
+    for (int i = 0; i < threads; ++i) {
+        args[i].ctx = &ctx;
+        args[i].id = i;
+    }
+
+    double start = now();
+    for (int i = 0; i < threads; ++i) {
+        pthread_create(tids + i, NULL, consumer<Queue>, args + i);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_create(tids + threads + i, NULL, producer<Queue>, args + i);
+    }
+    for (int i = 0; i < threads * 2; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    delete [] args;
+    delete [] tids;
+    delete ctx.queue;
+    return ctx.total / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long total = 2000000;
+    if (argc > 1) {
+        total = atol(argv[1]);
+    }
+
+    printf("%8s %16s %16s %16s\n", "threads", "list (ops/s)", "ring (ops/s)", "steal (ops/s)");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        double list_ops = run_bench<locked_queue<task> >(threads, total);
+        double ring_ops = run_bench<mpmc_queue<task> >(threads, total);
+        double steal_ops = run_bench<stealing_queue<task> >(threads, total);
+        printf("%8d %16.0f %16.0f %16.0f\n", threads, list_ops, ring_ops, steal_ops);
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+    保持连接时每个请求的固定开销的性能测试，模拟http_conn处理一个请求的过程：
+    准备读写缓冲区 -> 拷入请求 -> 找行尾、取出字段 -> 拼出文件路径 -> 生成响应头 -> 重置状态
+    比较三种缓冲区处理方式，统计每个请求平均的CPU周期数：
+    - bzero：原来的做法，连接对象中的固定数组，每个请求结束后bzero读缓冲区、写缓冲区和文件名
+    - 池+清零：从buffer_pool取缓冲区并整块清零，请求结束后归还
+    - 池：从buffer_pool取缓冲区不清零，只重置下标（现在的做法）
+
+    编译： g++ -std=c++11 -O2 reset_bench.cpp ../webserver/http_parser.cpp ../webserver/buffer_pool.cpp -o reset_bench
+    运行： ./reset_bench [每种请求的处理次数，默认200000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+#include "../webserver/http_parser.h"
+#include "../webserver/buffer_pool.h"
+
+static const int READ_BUFFER_SIZE = 2048;
+static const int WRITE_BUFFER_SIZE = 1024;
+static const int FILENAME_LEN = 200;
+static const int REPEAT = 5;
+static const char *doc_root = "/home/nowcoder/webserver/resources";
+
+static const char *corpus[] = {
+    // wrk
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+    // Chrome
+    "GET /images/banner.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1697000000; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "\r\n",
+};
+
+enum MODE {MODE_BZERO, MODE_POOL_ZERO, MODE_POOL};
+
+struct conn {
+    // MODE_BZERO使用的固定数组
+    char read_array[READ_BUFFER_SIZE];
+    char write_array[WRITE_BUFFER_SIZE];
+    char real_file_array[FILENAME_LEN];
+
+    char *read_buf;
+    int read_size;
+    char *write_buf;
+    int write_size;
+    int read_idx;
+    int checked_idx;
+    int write_idx;
+    bool linger;
+};
+
+// 解析请求并生成响应头，返回响应头的长度
+static int handle(conn &c, MODE mode) {
+    char *p = c.read_buf;
+    char *end = c.read_buf + c.read_idx;
+    char *url = NULL;
+    const char *line_end = http_parser::find_line_end(p, end);
+    // 请求行
+    url = (char *) memchr(p, ' ', line_end - p) + 1;
+    char *version = (char *) memchr(url, ' ', line_end - url);
+    *version = '\0';
+    p = (char *) line_end + 2;
+    // 头部字段
+    while (p < end && *p != '\r') {
+        line_end = http_parser::find_line_end(p, end);
+        const char *colon = http_parser::find_char2(p, line_end, ':', '\0');
+        if (http_parser::lookup_header(p, colon - p) == http_parser::HEADER_CONNECTION) {
+            c.linger = (line_end - colon == 12);
+        }
+        p = (char *) line_end + 2;
+    }
+    c.checked_idx = p + 2 - c.read_buf;
+
+    char *real_file = c.real_file_array;
+    char local_file[FILENAME_LEN];
+    int len = strlen(doc_root);
+    if (mode == MODE_BZERO) {
+        memcpy(real_file, doc_root, len);
+        strncpy(real_file + len, url, FILENAME_LEN - len - 1);
+    }
+    else {
+        real_file = local_file;
+        memcpy(real_file, doc_root, len);
+        int url_len = strnlen(url, FILENAME_LEN - len - 1);
+        memcpy(real_file + len, url, url_len);
+        real_file[len + url_len] = '\0';
+    }
+    __asm__ __volatile__("" : : "r"(real_file) : "memory");
+
+    c.write_idx = snprintf(c.write_buf, c.write_size, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nContent-Type: text/html\r\nConnection: %s\r\n\r\n",
+                           1234, c.linger ? "keep-alive" : "close");
+    return c.write_idx;
+}
+
+static double bench(MODE mode, const char *req, int len, long rounds) {
+    conn *c = new conn;
+    memset(c, 0, sizeof(*c));
+    unsigned long long begin = __rdtsc();
+    for (long i = 0; i < rounds; ++i) {
+        if (mode == MODE_BZERO) {
+            c->read_buf = c->read_array;
+            c->read_size = READ_BUFFER_SIZE;
+            c->write_buf = c->write_array;
+            c->write_size = WRITE_BUFFER_SIZE;
+        }
+        else {
+            c->read_buf = buffer_pool::acquire(READ_BUFFER_SIZE, c->read_size);
+            c->write_buf = buffer_pool::acquire(WRITE_BUFFER_SIZE, c->write_size);
+            if (mode == MODE_POOL_ZERO) {
+                memset(c->read_buf, 0, c->read_size);
+                memset(c->write_buf, 0, c->write_size);
+            }
+        }
+
+        memcpy(c->read_buf, req, len);
+        c->read_idx = len;
+        c->read_buf[len] = '\0';
+        if (handle(*c, mode) <= 0) {
+            printf("handle failed\n");
+            exit(1);
+        }
+        __asm__ __volatile__("" : : "r"(c->write_buf) : "memory");
+
+        // 响应发送完，为下一个请求重置
+        if (mode == MODE_BZERO) {
+            bzero(c->read_array, READ_BUFFER_SIZE);
+            bzero(c->write_array, WRITE_BUFFER_SIZE);
+            bzero(c->real_file_array, FILENAME_LEN);
+        }
+        else {
+            buffer_pool::release(c->read_buf, c->read_size);
+            buffer_pool::release(c->write_buf, c->write_size);
+        }
+        c->read_idx = 0;
+        c->checked_idx = 0;
+        c->write_idx = 0;
+        c->linger = false;
+    }
+    double cycles = (double)(__rdtsc() - begin) / rounds;
+    delete c;
+    return cycles;
+}
+
+int main(int argc, char *argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    static const char *names[] = {"wrk", "chrome"};
+    const int count = sizeof(corpus) / sizeof(corpus[0]);
+
+    printf("每种请求处理%ld次，单位: 周期/请求\n", rounds);
+    printf("%-8s %6s %10s %10s %10s\n", "请求", "字节", "bzero", "池+清零", "池");
+    for (int i = 0; i < count; ++i) {
+        int len = strlen(corpus[i]);
+        printf("%-8s %6d", names[i], len);
+        for (int mode = MODE_BZERO; mode <= MODE_POOL; ++mode) {
+            // 差别只有几十个周期，取几次中最好的一次，减少其他进程和频率变化的干扰
+            double best = 0;
+            for (int r = 0; r < REPEAT; ++r) {
+                double cycles = bench((MODE) mode, corpus[i], len, rounds);
+                if (r == 0 || cycles < best) {
+                    best = cycles;
+                }
+            }
+            printf(" %10.0f", best);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+    空闲连接定时器的性能测试，比较升序链表sort_timer_lst、分层时间轮timer_wheel和4叉最小堆timer_heap
+    三者的定时器都是连接对象的成员，添加、调整、到期都不分配内存
+    模拟n个保持连接：先为每个连接添加一个定时器，然后测量
+    - add：新连接添加定时器（超时时间比已有的都晚，链表要走到尾部）
+    - refresh：随机一个连接有了读写，把它的定时器推迟到最晚（链表的adjust_timer要从原位置走到尾部）
+    - del：连接关闭，删除定时器
+    - expire：所有定时器到期，由tick批量处理
+    统计每次操作平均的纳秒数，链表在n很大时很慢，add和refresh只测一部分操作
+
+    编译： g++ -std=c++11 -O2 timer_bench.cpp -o timer_bench
+    运行： ./timer_bench [每种规模测量的add/refresh次数，默认1000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "../noactive/lst_timer.h"
+#include "../webserver/timer_wheel.h"
+#include "../webserver/timer_heap.h"
+
+static const int TIMEOUT_MS = 60 * 1000; // 保持连接的超时时间
+static const int TICK_MS = 100;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long expired = 0;
+
+static void list_cb(client_data *) {
+    ++expired;
+}
+
+static void node_cb(void *) {
+    ++expired;
+}
+
+struct result {
+    double add, refresh, del, expire;
+};
+
+// 链表中的expire是秒，这里直接用递增的整数表示时间，和真实时间无关
+static result bench_list(int n, int ops) {
+    result res;
+    std::vector<client_data> users(n + ops);
+    sort_timer_lst lst;
+    // 按超时时间从晚到早插入，每次都插在头部，只是为了快速建好n个定时器的链表
+    for (int i = n - 1; i >= 0; --i) {
+        util_timer *timer = &users[i].timer;
+        timer->expire = i;
+        timer->cb_func = list_cb;
+        timer->user_data = &users[i];
+        lst.add_timer(timer);
+    }
+    time_t latest = n;
+
+    double begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        util_timer *timer = &users[n + i].timer;
+        timer->expire = latest++;
+        timer->cb_func = list_cb;
+        timer->user_data = &users[n + i];
+        lst.add_timer(timer);
+    }
+    res.add = (now_ns() - begin) / ops;
+
+    begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        util_timer *timer = &users[rand() % n].timer;
+        timer->expire = latest++;
+        lst.adjust_timer(timer);
+    }
+    res.refresh = (now_ns() - begin) / ops;
+
+    begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        lst.del_timer(&users[n + i].timer);
+    }
+    res.del = (now_ns() - begin) / ops;
+
+    // 所有定时器都到期，tick从头部依次处理（用time(NULL)判断，现在的时间晚于所有的expire）
+    expired = 0;
+    begin = now_ns();
+    lst.tick();
+    res.expire = (now_ns() - begin) / (expired ? expired : 1);
+    return res;
+}
+
+// 时间轮和堆的接口相同，Container是定时器容器的类型
+template<typename Container>
+static result bench_container(int n, int ops) {
+    result res;
+    std::vector<timer_node> timers(n + ops);
+    Container container(TICK_MS);
+    // 新连接的超时时间随着时间推移不断变晚，这里把n个连接均匀地分布在一个超时周期中
+    for (int i = 0; i < n; ++i) {
+        timers[i].cb_func = node_cb;
+        container.add_timer(&timers[i], TIMEOUT_MS - (long) TIMEOUT_MS * (n - i) / n);
+    }
+
+    double begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        timers[n + i].cb_func = node_cb;
+        container.add_timer(&timers[n + i], TIMEOUT_MS);
+    }
+    res.add = (now_ns() - begin) / ops;
+
+    begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        container.adjust_timer(&timers[rand() % n], TIMEOUT_MS);
+    }
+    res.refresh = (now_ns() - begin) / ops;
+
+    begin = now_ns();
+    for (int i = 0; i < ops; ++i) {
+        container.del_timer(&timers[n + i]);
+    }
+    res.del = (now_ns() - begin) / ops;
+
+    // 转过一个超时周期，所有定时器到期
+    expired = 0;
+    begin = now_ns();
+    for (int i = 0; i <= TIMEOUT_MS / TICK_MS; ++i) {
+        container.tick();
+    }
+    res.expire = (now_ns() - begin) / (expired ? expired : 1);
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : 1000;
+    static const int sizes[] = {1000, 10000, 100000};
+
+    printf("每种规模add/refresh/del各%d次，单位: 纳秒/次\n", ops);
+    printf("%-8s %-6s %10s %10s %10s %10s\n", "定时器数", "容器", "add", "refresh", "del", "expire");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        int n = sizes[i];
+        int k = ops < n ? ops : n;
+        result l = bench_list(n, k);
+        printf("%-8d %-6s %10.0f %10.0f %10.0f %10.1f\n", n, "list", l.add, l.refresh, l.del, l.expire);
+        result w = bench_container<timer_wheel>(n, k);
+        printf("%-8d %-6s %10.0f %10.0f %10.0f %10.1f\n", n, "wheel", w.add, w.refresh, w.del, w.expire);
+        result h = bench_container<timer_heap<4> >(n, k);
+        printf("%-8d %-6s %10.0f %10.0f %10.0f %10.1f\n", n, "heap4", h.add, h.refresh, h.del, h.expire);
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+namespace {
+
+// 空闲缓冲区的前8个字节用来串成链表
+struct free_node {
+    free_node *next;
+};
+
+struct thread_cache {
+    free_node *heads[buffer_pool::CLASSES];
+    int counts[buffer_pool::CLASSES];
+
+    thread_cache() {
+        for (int i = 0; i < buffer_pool::CLASSES; ++i) {
+            heads[i] = NULL;
+            counts[i] = 0;
+        }
+    }
+
+    // 线程退出时释放缓存的缓冲区
+    ~thread_cache() {
+        for (int i = 0; i < buffer_pool::CLASSES; ++i) {
+            while (heads[i]) {
+                free_node *node = heads[i];
+                heads[i] = node->next;
+                free(node);
+            }
+        }
+    }
+};
+
+thread_local thread_cache t_cache;
+
+int class_of(int capacity) {
+    int cls = 0;
+    while ((buffer_pool::MIN_SIZE << cls) < capacity) {
+        ++cls;
+    }
+    return cls;
+}
+
+}
+
+int buffer_pool::round_up(int size) {
+    int capacity = MIN_SIZE;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+char *buffer_pool::acquire(int size, int &capacity) {
+    capacity = round_up(size);
+    if (capacity > MAX_SIZE) {
+        return (char *) malloc(capacity);
+    }
+
+    int cls = class_of(capacity);
+    free_node *node = t_cache.heads[cls];
+    if (node) {
+        t_cache.heads[cls] = node->next;
+        --t_cache.counts[cls];
+        return (char *) node;
+    }
+    return (char *) malloc(capacity);
+}
+
+void buffer_pool::release(char *buf, int capacity) {
+    if (!buf) {
+        return;
+    }
+    if (capacity > MAX_SIZE) {
+        free(buf);
+        return;
+    }
+
+    int cls = class_of(capacity);
+    if (t_cache.counts[cls] >= CACHE_LIMIT) {
+        free(buf);
+        return;
+    }
+    free_node *node = (free_node *) buf;
+    node->next = t_cache.heads[cls];
+    t_cache.heads[cls] = node;
+    ++t_cache.counts[cls];
+}
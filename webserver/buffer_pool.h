@@ -0,0 +1,27 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+/*
+    连接读写缓冲区的内存池
+    - 缓冲区的大小按2的幂分成若干等级（1KB ~ 64KB），申请时向上取整到等级的大小
+    - 每个线程为每个等级缓存一定数量的空闲缓冲区，申请和归还都不需要加锁；
+      归还到的是归还线程自己的缓存，所以在reactor线程申请、在工作线程归还也没有问题
+    - 超过最大等级的缓冲区直接用malloc和free
+*/
+class buffer_pool {
+public:
+    static const int MIN_SIZE = 1024;
+    static const int CLASSES = 7; // 1KB、2KB、... 64KB
+    static const int MAX_SIZE = MIN_SIZE << (CLASSES - 1);
+    static const int CACHE_LIMIT = 64; // 每个线程每个等级最多缓存的空闲缓冲区数
+
+    // 申请至少size字节的缓冲区，capacity返回实际的大小，失败时返回NULL
+    static char *acquire(int size, int &capacity);
+    // 归还缓冲区，capacity必须是acquire返回的大小
+    static void release(char *buf, int capacity);
+
+    // 不小于size的等级大小
+    static int round_up(int size);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "conn_timers.h"
+#include "http_conn.h"
+#include "stats.h"
+
+conn_timers::CONTAINER conn_timers::m_container = conn_timers::WHEEL; // 默认使用时间轮
+
+conn_timers *conn_timers::create() {
+    if (m_container == HEAP) {
+        return new conn_timer_set<timer_heap<4> >();
+    }
+    return new conn_timer_set<timer_wheel>();
+}
+
+void conn_timers::attach(http_conn *conn) {
+    m_locker.lock();
+    conn->m_timers = this;
+    conn->m_timer.cb_func = on_expire;
+    conn->m_timer.user_data = conn;
+    m_locker.unlock();
+}
+
+void conn_timers::arm(http_conn *conn, int timeout_ms) {
+    m_locker.lock();
+    if (conn->m_timers == this) {
+        if (timeout_ms > 0) {
+            // 当前的tick已经过去了一部分，多加一个tick，保证不会提前到期
+            add(&conn->m_timer, timeout_ms + TICK_MS);
+        }
+        else {
+            del(&conn->m_timer);
+        }
+    }
+    m_locker.unlock();
+}
+
+void conn_timers::detach(http_conn *conn) {
+    m_locker.lock();
+    if (conn->m_timers == this) {
+        del(&conn->m_timer);
+        conn->m_timers = NULL;
+    }
+    m_locker.unlock();
+}
+
+void conn_timers::collect(std::vector<http_conn *> &expired) {
+    // 事件循环处理得慢、错过了几个tick时一次补上
+    uint64_t ticks = read_tick_timerfd(m_timerfd);
+    if (ticks == 0) {
+        return;
+    }
+    m_locker.lock();
+    while (ticks-- > 0) {
+        tick();
+    }
+    expired.swap(m_expired);
+    m_locker.unlock();
+}
+
+void conn_timers::retry(http_conn *conn) {
+    m_locker.lock();
+    if (conn->m_timers == this && !pending(&conn->m_timer)) {
+        add(&conn->m_timer, TICK_MS);
+    }
+    m_locker.unlock();
+}
+
+int conn_timers::expired(http_conn *conn) {
+    int kind = -1;
+    m_locker.lock();
+    // 到期之后所有者又设置了定时器，说明连接进入了新的阶段
+    if (conn->m_timers == this && !pending(&conn->m_timer) && conn->m_timeout_kind >= 0
+        && http_conn::m_timeout_ms[conn->m_timeout_kind] > 0) {
+        kind = conn->m_timeout_kind;
+    }
+    m_locker.unlock();
+    return kind;
+}
+
+void conn_timers::count(int kind) {
+    server_stats *stats = server_stats::get();
+    switch (kind) {
+        case http_conn::TIMEOUT_IDLE:
+            ++stats->idle_timeouts;
+            break;
+        case http_conn::TIMEOUT_HEADER:
+            ++stats->header_timeouts;
+            break;
+        case http_conn::TIMEOUT_WRITE:
+            ++stats->write_timeouts;
+            break;
+        default:
+            break;
+    }
+}
+
+// 在collect持有锁的时候被定时器容器调用，节点已经从容器中摘下
+void conn_timers::on_expire(void *data) {
+    http_conn *conn = (http_conn *) data;
+    conn->m_timers.load()->m_expired.push_back(conn);
+}
@@ -0,0 +1,89 @@
+#ifndef CONN_TIMERS_H
+#define CONN_TIMERS_H
+
+#include <vector>
+#include "locker.h"
+#include "timer_node.h"
+#include "timer_wheel.h"
+#include "timer_heap.h"
+
+class http_conn;
+
+/*
+    连接的超时管理，每个事件循环一个，超时的连接由事件循环关闭
+    - 定时器节点是http_conn的成员，连接的所有者在交还所有权时按照连接所处的阶段（等待请求头、发送响应、
+      空闲的保持连接）设置，所有者可能是线程池中的线程，所以定时器容器由互斥锁保护
+    - tick由timerfd驱动，到期的连接先在锁内收集起来，解锁之后再由事件循环检查和关闭，
+      关闭连接时要再次加锁删除定时器
+    - 连接关闭之后fd可能被其他事件循环复用，http_conn::m_timers记录定时器在哪个容器中，
+      只有它指向本对象时才会操作连接的定时器
+    这个类和定时器容器的实现无关，http_conn和事件循环只依赖它，具体的容器由conn_timer_set的模板参数决定
+*/
+class conn_timers {
+public:
+    static const int TICK_MS = 500; // 定时器的精度
+
+    // 定时器容器：分层时间轮或者4叉最小堆
+    enum CONTAINER {WHEEL = 0, HEAP};
+    static CONTAINER m_container; // 新建的事件循环使用的容器，由main设置
+
+    // 按m_container创建，失败时抛出异常
+    static conn_timers *create();
+
+    virtual ~conn_timers() {}
+
+    int get_fd() const { return m_timerfd; } // 可读时调用collect
+
+    void attach(http_conn *conn); // 由本对象管理连接的超时，在初始化新连接时调用
+    void arm(http_conn *conn, int timeout_ms); // timeout_ms毫秒之后到期，不大于0时取消定时器
+    void detach(http_conn *conn); // 连接关闭，删除定时器，必须在关闭fd之前调用
+
+    // 读出timerfd，推进定时器，到期的连接放进expired
+    void collect(std::vector<http_conn *> &expired);
+    // 到期时连接正在被其他线程推进，下一个tick再检查
+    void retry(http_conn *conn);
+    // 拥有连接之后检查它是否确实超时：定时器没有被重新设置，返回超时的阶段（http_conn::TIMEOUT_KIND），否则返回-1
+    int expired(http_conn *conn);
+    // 统计超时关闭的连接
+    static void count(int kind);
+
+protected:
+    conn_timers() : m_timerfd(-1) {}
+
+    // 下面这一组函数由具体的容器实现，调用时已经持有m_locker
+    virtual void add(timer_node *timer, int timeout_ms) = 0;
+    virtual void del(timer_node *timer) = 0;
+    virtual bool pending(const timer_node *timer) const = 0;
+    virtual void tick() = 0;
+
+    int m_timerfd; // 周期为一个tick的timerfd，由容器拥有
+
+private:
+    static void on_expire(void *data);
+
+    locker m_locker; // 保护定时器容器和所有连接的定时器
+    std::vector<http_conn *> m_expired; // tick过程中到期的连接
+};
+
+// Container是定时器容器的实现：timer_wheel或者timer_heap<ARITY>
+template<typename Container>
+class conn_timer_set : public conn_timers {
+public:
+    conn_timer_set() : m_timers(TICK_MS) {
+        m_timerfd = m_timers.timerfd();
+        if (m_timerfd == -1) {
+            throw std::exception();
+        }
+    }
+
+protected:
+    void add(timer_node *timer, int timeout_ms) override { m_timers.add_timer(timer, timeout_ms); }
+    void del(timer_node *timer) override { m_timers.del_timer(timer); }
+    bool pending(const timer_node *timer) const override { return m_timers.pending(timer); }
+    void tick() override { m_timers.tick(); }
+
+private:
+    Container m_timers;
+};
+
+#endif
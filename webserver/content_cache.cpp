@@ -0,0 +1,335 @@
+#include "content_cache.h"
+#include "stats.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+content_cache::content_cache(size_t budget) : m_arena(NULL), m_arena_size(0), m_huge(false) {
+    // 按大页对齐，每个分片至少有一个slab
+    m_arena_size = (budget + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (m_arena_size < (size_t) SLAB_SIZE * SHARDS) {
+        throw std::exception();
+    }
+
+    // 优先使用预留的大页，没有时退回普通页并建议内核使用透明大页
+    void *p = mmap(NULL, m_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        m_huge = true;
+    }
+    else {
+        p = mmap(NULL, m_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::exception();
+        }
+        madvise(p, m_arena_size, MADV_HUGEPAGE);
+    }
+    m_arena = (char *) p;
+
+    int slabs = m_arena_size / SLAB_SIZE;
+    m_slabs.resize(slabs);
+    int per_shard = slabs / SHARDS;
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        s.first = i * per_shard;
+        s.count = (i == SHARDS - 1) ? slabs - s.first : per_shard;
+        s.free_slabs = -1;
+        for (int c = 0; c < CLASSES; ++c) {
+            s.partial[c] = -1;
+        }
+        s.small_bytes = 0;
+        s.main_bytes = 0;
+        for (int j = s.first + s.count - 1; j >= s.first; --j) {
+            m_slabs[j].cls = -1;
+            m_slabs[j].used = 0;
+            m_slabs[j].free_list = NULL;
+            list_push(s.free_slabs, j);
+        }
+    }
+}
+
+content_cache::~content_cache() {
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        while (!s.map.empty()) {
+            drop(s, s.map.begin()->second);
+        }
+        s.lock.unlock();
+    }
+    munmap(m_arena, m_arena_size);
+}
+
+int content_cache::class_of(int len) {
+    int cls = 0;
+    while ((MIN_BLOCK << cls) < len) {
+        ++cls;
+    }
+    return cls;
+}
+
+bool content_cache::same_file(const struct stat &a, const struct stat &b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+// slab链表用m_slabs中的下标串起来，-1表示链表结束
+void content_cache::list_push(int &head, int i) {
+    m_slabs[i].prev = -1;
+    m_slabs[i].next = head;
+    if (head != -1) {
+        m_slabs[head].prev = i;
+    }
+    head = i;
+}
+
+void content_cache::list_remove(int &head, int i) {
+    slab &sl = m_slabs[i];
+    if (sl.prev != -1) {
+        m_slabs[sl.prev].next = sl.next;
+    }
+    else {
+        head = sl.next;
+    }
+    if (sl.next != -1) {
+        m_slabs[sl.next].prev = sl.prev;
+    }
+}
+
+char *content_cache::alloc_block(shard &s, int cls) {
+    int size = MIN_BLOCK << cls;
+    int i = s.partial[cls];
+    if (i == -1) {
+        // 这个等级没有空闲块了，拿一个空闲slab切成这个等级的块
+        i = s.free_slabs;
+        if (i == -1) {
+            return NULL;
+        }
+        list_remove(s.free_slabs, i);
+        slab &sl = m_slabs[i];
+        sl.cls = cls;
+        sl.used = 0;
+        sl.free_list = NULL;
+        char *base = m_arena + (size_t) i * SLAB_SIZE;
+        for (int off = SLAB_SIZE - size; off >= 0; off -= size) {
+            *(char **)(base + off) = sl.free_list;
+            sl.free_list = base + off;
+        }
+        list_push(s.partial[cls], i);
+    }
+
+    slab &sl = m_slabs[i];
+    char *block = sl.free_list;
+    sl.free_list = *(char **) block;
+    ++sl.used;
+    if (!sl.free_list) {
+        list_remove(s.partial[cls], i);
+    }
+    server_stats::get()->content_bytes += size;
+    return block;
+}
+
+void content_cache::free_block(shard &s, char *block) {
+    int i = (block - m_arena) / SLAB_SIZE;
+    slab &sl = m_slabs[i];
+    bool was_full = (sl.free_list == NULL);
+    *(char **) block = sl.free_list;
+    sl.free_list = block;
+    --sl.used;
+    server_stats::get()->content_bytes -= MIN_BLOCK << sl.cls;
+
+    if (sl.used == 0) {
+        // 整个slab都空闲了，归还之后可以分配给其他等级
+        if (!was_full) {
+            list_remove(s.partial[sl.cls], i);
+        }
+        sl.cls = -1;
+        list_push(s.free_slabs, i);
+    }
+    else if (was_full) {
+        list_push(s.partial[sl.cls], i);
+    }
+}
+
+void content_cache::put_ghost(shard &s, size_t hash) {
+    if (!s.ghost_set.insert(hash).second) {
+        return;
+    }
+    s.ghost.push_back(hash);
+    // 幽灵队列记住的键和缓存中的对象数差不多
+    size_t limit = s.map.size() > 64 ? s.map.size() : 64;
+    while (s.ghost.size() > limit) {
+        s.ghost_set.erase(s.ghost.front());
+        s.ghost.pop_front();
+    }
+}
+
+void content_cache::unref_locked(shard &s, entry *e) {
+    if (--e->refs == 0) {
+        free_block(s, e->data);
+        delete e;
+    }
+}
+
+void content_cache::drop(shard &s, entry *e) {
+    size_t size = MIN_BLOCK << e->cls;
+    s.map.erase(e->path);
+    if (e->queue == QUEUE_SMALL) {
+        s.small.erase(e->pos);
+        s.small_bytes -= size;
+    }
+    else if (e->queue == QUEUE_MAIN) {
+        s.main.erase(e->pos);
+        s.main_bytes -= size;
+    }
+    e->queue = QUEUE_NONE;
+    unref_locked(s, e);
+}
+
+// 按S3-FIFO处理一个对象，返回false表示缓存已经空了
+// 被淘汰的对象如果还有连接在使用，内存要等它们释放之后才能回收
+bool content_cache::evict_one(shard &s) {
+    size_t small_target = (size_t) s.count * SLAB_SIZE / 10;
+    if (!s.small.empty() && (s.small_bytes >= small_target || s.main.empty())) {
+        entry *e = s.small.back();
+        if (e->freq > 1) {
+            // 在小队列中被访问过至少两次，移到主队列
+            size_t size = MIN_BLOCK << e->cls;
+            s.small.pop_back();
+            s.small_bytes -= size;
+            e->freq = 0;
+            e->queue = QUEUE_MAIN;
+            s.main.push_front(e);
+            e->pos = s.main.begin();
+            s.main_bytes += size;
+            return true;
+        }
+        put_ghost(s, e->hash);
+        drop(s, e);
+        ++server_stats::get()->content_evictions;
+        return true;
+    }
+
+    if (!s.main.empty()) {
+        entry *e = s.main.back();
+        if (e->freq > 0) {
+            --e->freq;
+            s.main.splice(s.main.begin(), s.main, e->pos);
+            return true;
+        }
+        drop(s, e);
+        ++server_stats::get()->content_evictions;
+        return true;
+    }
+    return false;
+}
+
+content_cache::entry *content_cache::acquire(const char *path, const struct stat &st, int fd) {
+    if (st.st_size > MAX_OBJECT) {
+        return NULL;
+    }
+
+    std::string key(path);
+    size_t hash = std::hash<std::string>()(key);
+    int index = hash % SHARDS;
+    shard &s = m_shards[index];
+    server_stats *stats = server_stats::get();
+
+    s.lock.lock();
+    std::unordered_map<std::string, entry *>::iterator it = s.map.find(key);
+    if (it != s.map.end()) {
+        entry *e = it->second;
+        if (same_file(e->st, st)) {
+            ++e->refs;
+            if (e->freq < 3) {
+                ++e->freq;
+            }
+            s.lock.unlock();
+            ++stats->content_hits;
+            return e;
+        }
+        // 文件已经被修改
+        drop(s, e);
+    }
+
+    int len = st.st_size;
+    int cls = class_of(len);
+    char *block = NULL;
+    for (int i = 0; i < MAX_EVICT && !(block = alloc_block(s, cls)); ++i) {
+        if (!evict_one(s)) {
+            break;
+        }
+    }
+    s.lock.unlock();
+    ++stats->content_misses;
+    if (!block) {
+        return NULL;
+    }
+
+    // 在锁外读入文件内容
+    int n = 0;
+    while (n < len) {
+        ssize_t ret = pread(fd, block + n, len - n, n);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        n += ret;
+    }
+    if (n != len) {
+        s.lock.lock();
+        free_block(s, block);
+        s.lock.unlock();
+        return NULL;
+    }
+
+    entry *e = new entry;
+    e->path = key;
+    e->hash = hash;
+    e->st = st;
+    e->data = block;
+    e->len = len;
+    e->shard = index;
+    e->cls = cls;
+    e->freq = 0;
+    e->refs = 2; // 缓存和调用者各一个
+
+    s.lock.lock();
+    it = s.map.find(key);
+    if (it != s.map.end()) {
+        // 其他线程同时加载了同一个文件，用新加载的替换掉
+        drop(s, it->second);
+    }
+    size_t size = MIN_BLOCK << cls;
+    if (s.ghost_set.erase(hash)) {
+        // 不久前刚被淘汰过，说明不是只访问一次的对象，直接进入主队列
+        e->queue = QUEUE_MAIN;
+        s.main.push_front(e);
+        e->pos = s.main.begin();
+        s.main_bytes += size;
+    }
+    else {
+        e->queue = QUEUE_SMALL;
+        s.small.push_front(e);
+        e->pos = s.small.begin();
+        s.small_bytes += size;
+    }
+    s.map[key] = e;
+    s.lock.unlock();
+    return e;
+}
+
+void content_cache::release(entry *e) {
+    if (--e->refs == 0) {
+        // 已经不在缓存中，最后一个使用者归还内存
+        shard &s = m_shards[e->shard];
+        s.lock.lock();
+        free_block(s, e->data);
+        s.lock.unlock();
+        delete e;
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <atomic>
+#include <list>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "locker.h"
+
+/*
+    小文件内容的内存缓存，以文件的完整路径为键，缓存命中时响应头和缓存中的文件内容用一次writev发出，
+    不需要mmap、munmap或者sendfile
+    - 内存：启动时一次性申请预算大小的内存区域（尽量使用大页），切成64KB的slab，
+      每个slab按需分配给某个大小等级（512B ~ 64KB，2的幂），slab中的块全部释放后归还，可以分配给其他等级
+    - 淘汰：S3-FIFO，新对象先进入小队列（约占10%的内存），在小队列中被访问过至少两次才进入主队列，
+      否则淘汰并把键的哈希记在幽灵队列中，幽灵队列中的键再次被加载时直接进入主队列；
+      主队列按FIFO淘汰，被访问过的对象减少一次计数后重新放回队头（CLOCK）
+    - 分成多个分片，每个分片有自己的锁、内存、队列，缓存项带引用计数，被淘汰时正在使用它的连接仍然可以继续发送
+    - 缓存项记录了文件的inode、大小、修改时间，和文件缓存中（定期重新stat过的）状态不一致时重新加载
+*/
+class content_cache {
+public:
+    static const int SHARDS = 8;
+    static const int SLAB_SIZE = 64 * 1024;
+    static const int MIN_BLOCK = 512;
+    static const int CLASSES = 8; // 512B、1KB、... 64KB
+    static const int MAX_OBJECT = SLAB_SIZE; // 能缓存的最大文件
+
+    struct entry {
+        std::string path;
+        size_t hash; // path的哈希
+        struct stat st;
+        char *data;
+        int len;
+
+        // 下面的成员只在分片的锁内访问
+        int shard;
+        int cls;
+        int queue; // 所在的队列，见QUEUE
+        std::list<entry *>::iterator pos;
+        int freq; // 进入队列之后被访问的次数，最大为3
+
+        std::atomic<int> refs;
+    };
+
+    // budget为缓存文件内容使用的内存字节数
+    explicit content_cache(size_t budget);
+    ~content_cache();
+
+    /*
+        获取path对应的文件内容，st为文件当前的状态，fd为打开的文件，未命中时从fd中读入
+        返回增加了引用计数的缓存项，用完之后调用release；文件太大、读取失败或者腾不出内存时返回NULL
+    */
+    entry *acquire(const char *path, const struct stat &st, int fd);
+    void release(entry *e);
+
+    bool huge_pages() const { return m_huge; }
+    size_t budget() const { return m_arena_size; }
+
+private:
+    enum QUEUE {QUEUE_NONE = 0, QUEUE_SMALL, QUEUE_MAIN};
+
+    static const int MAX_EVICT = 64; // 一次分配最多淘汰的对象数，超过之后放弃缓存这个文件
+
+    struct slab {
+        int cls; // -1表示空闲
+        int used; // 已经分配出去的块数
+        char *free_list; // 空闲块链表，块的前8个字节是下一个空闲块
+        int prev, next; // 所在的slab链表（空闲slab链表或者某个等级的部分空闲链表）
+    };
+
+    struct shard {
+        locker lock;
+        int first; // 第一个slab在m_slabs中的下标
+        int count; // slab数
+        int free_slabs; // 空闲slab链表
+        int partial[CLASSES]; // 每个等级还有空闲块的slab链表
+        std::unordered_map<std::string, entry *> map;
+        std::list<entry *> small; // 新对象在前面
+        std::list<entry *> main;
+        size_t small_bytes;
+        size_t main_bytes;
+        std::deque<size_t> ghost; // 从小队列中淘汰的键的哈希，先进先出
+        std::unordered_set<size_t> ghost_set;
+    };
+
+    char *m_arena;
+    size_t m_arena_size;
+    bool m_huge; // 是否成功使用了大页
+    std::vector<slab> m_slabs;
+    shard m_shards[SHARDS];
+
+    static int class_of(int len);
+    static bool same_file(const struct stat &a, const struct stat &b);
+
+    // 下面的函数都在分片的锁内调用
+    void list_push(int &head, int i);
+    void list_remove(int &head, int i);
+    char *alloc_block(shard &s, int cls);
+    void free_block(shard &s, char *block);
+    bool evict_one(shard &s);
+    void drop(shard &s, entry *e); // 把缓存项移出缓存，并释放缓存持有的引用
+    void put_ghost(shard &s, size_t hash);
+    void unref_locked(shard &s, entry *e);
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include "cpu_topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <map>
+#include <utility>
+#include <algorithm>
+
+cpu_topology::cpu_topology() {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == -1) {
+        // 读不到亲和性时认为所有在线的CPU都可用
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < n && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, &cpuset);
+        }
+    }
+
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &cpuset)) {
+            cpu_info info;
+            memset(&info, 0, sizeof(info));
+            info.cpu = i;
+            m_cpus.push_back(info);
+        }
+    }
+
+    load_nodes();
+    load_cores();
+}
+
+int cpu_topology::read_int(const char *path, int def) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return def;
+    }
+    int val = def;
+    if (fscanf(fp, "%d", &val) != 1) {
+        val = def;
+    }
+    fclose(fp);
+    return val;
+}
+
+bool cpu_topology::parse_cpu_list(const char *str, std::vector<int> &cpus) {
+    cpus.clear();
+    const char *p = str;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        for (long i = first; i <= last; ++i) {
+            cpus.push_back(i);
+        }
+        if (*p == ',') {
+            ++p;
+        }
+        else if (*p && *p != '\n') {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+// 节点信息在/sys/devices/system/node/nodeN/cpulist中
+void cpu_topology::load_nodes() {
+    std::vector<int> ids;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            int id;
+            char tail;
+            if (sscanf(ent->d_name, "node%d%c", &id, &tail) == 1) {
+                ids.push_back(id);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        char line[4096] = {0};
+        std::vector<int> cpus;
+        bool ok = fgets(line, sizeof(line), fp) && parse_cpu_list(line, cpus);
+        fclose(fp);
+        if (!ok) {
+            continue;
+        }
+
+        node_info node;
+        node.id = ids[i];
+        for (size_t j = 0; j < m_cpus.size(); ++j) {
+            if (std::find(cpus.begin(), cpus.end(), m_cpus[j].cpu) != cpus.end()) {
+                m_cpus[j].node = m_nodes.size();
+                node.cpus.push_back(m_cpus[j].cpu);
+            }
+        }
+        if (!node.cpus.empty()) {
+            m_nodes.push_back(node);
+        }
+    }
+
+    if (m_nodes.empty()) {
+        node_info node;
+        node.id = 0;
+        for (size_t j = 0; j < m_cpus.size(); ++j) {
+            m_cpus[j].node = 0;
+            node.cpus.push_back(m_cpus[j].cpu);
+        }
+        m_nodes.push_back(node);
+    }
+}
+
+// 物理核信息在/sys/devices/system/cpu/cpuN/topology中，读不到时每个CPU当作一个单独的物理核
+void cpu_topology::load_cores() {
+    std::map<std::pair<int, int>, int> siblings; // (插槽, 物理核) -> 已经出现的超线程数
+    std::vector<std::map<std::pair<int, int>, int> > node_cores(m_nodes.size()); // 每个节点中 (插槽, 物理核) -> 序号
+    for (size_t i = 0; i < m_cpus.size(); ++i) {
+        cpu_info &info = m_cpus[i];
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", info.cpu);
+        info.package = read_int(path, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", info.cpu);
+        info.core = read_int(path, info.cpu);
+
+        std::pair<int, int> key(info.package, info.core);
+        info.sibling = siblings[key]++;
+
+        std::map<std::pair<int, int>, int> &cores = node_cores[info.node];
+        if (cores.find(key) == cores.end()) {
+            int rank = cores.size();
+            cores[key] = rank;
+        }
+        info.core_rank = cores[key];
+    }
+}
+
+int cpu_topology::node_of(int cpu) const {
+    for (size_t i = 0; i < m_cpus.size(); ++i) {
+        if (m_cpus[i].cpu == cpu) {
+            return m_cpus[i].node;
+        }
+    }
+    return 0;
+}
+
+std::vector<int> cpu_topology::pick(PIN_POLICY policy, int count, int node) const {
+    // 按照策略给每个CPU一个排序键，排序之后依次分配
+    std::vector<std::pair<std::vector<int>, int> > order;
+    for (size_t i = 0; i < m_cpus.size(); ++i) {
+        const cpu_info &info = m_cpus[i];
+        if (node >= 0 && info.node != node) {
+            continue;
+        }
+        std::vector<int> key;
+        if (policy == PIN_SCATTER) {
+            // 先用每个物理核的第一个超线程，并且在节点之间轮流
+            key.push_back(info.sibling);
+            key.push_back(info.core_rank);
+            key.push_back(info.node);
+        }
+        else {
+            // 同一个节点、同一个物理核的CPU排在一起
+            key.push_back(info.node);
+            key.push_back(info.package);
+            key.push_back(info.core);
+        }
+        key.push_back(info.cpu);
+        order.push_back(std::make_pair(key, info.cpu));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> cpus;
+    for (int i = 0; i < count && !order.empty(); ++i) {
+        cpus.push_back(order[i % order.size()].second);
+    }
+    return cpus;
+}
+
+bool cpu_topology::interleave(void *addr, size_t len) const {
+    if (m_nodes.size() <= 1) {
+        return true;
+    }
+
+    unsigned long mask[16];
+    memset(mask, 0, sizeof(mask));
+    const int bits = sizeof(unsigned long) * 8;
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        int id = m_nodes[i].id;
+        if (id < (int)(sizeof(mask) * 8)) {
+            mask[id / bits] |= 1UL << (id % bits);
+        }
+    }
+
+    // mbind要求起始地址按页对齐，只处理中间完整的页
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long) addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long) addr + len) & ~(page - 1);
+    if (end <= start) {
+        return true;
+    }
+    if (syscall(SYS_mbind, start, end - start, MPOL_INTERLEAVE, mask, sizeof(mask) * 8, MPOL_MF_MOVE) == -1) {
+        perror("mbind");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <stddef.h>
+#include <vector>
+
+/*
+    机器的CPU拓扑，从/sys/devices/system下读取，只包含本进程允许运行的CPU（sched_getaffinity，会受taskset和cgroup限制）
+    用于决定线程的数量，以及把线程池的工作线程和事件循环线程绑定到哪些CPU上
+    没有NUMA信息时（例如容器中没有挂载/sys/devices/system/node）当作只有一个节点
+*/
+class cpu_topology {
+public:
+    // 绑定CPU的策略
+    enum PIN_POLICY {
+        PIN_NONE = 0,   // 不绑定
+        PIN_COMPACT,    // 紧凑：先占满一个节点，同一个物理核的超线程相邻，线程之间共享缓存
+        PIN_SCATTER,    // 分散：轮流使用各个节点和物理核，超线程最后才用，每个线程独享物理核和内存带宽
+        PIN_LIST        // 按照给定的CPU列表
+    };
+
+    cpu_topology();
+
+    int cpu_count() const { return m_cpus.size(); } // 可用的CPU数
+    int node_count() const { return m_nodes.size(); } // NUMA节点数（只算有可用CPU的节点）
+    const std::vector<int> &node_cpus(int node) const { return m_nodes[node].cpus; } // 节点中可用的CPU
+    int node_of(int cpu) const; // CPU所在节点的下标，不可用的CPU返回0
+
+    // 按照策略为count个线程选择CPU，线程比CPU多时循环使用，node为-1表示在所有节点中选择，否则只在这个节点中选择
+    std::vector<int> pick(PIN_POLICY policy, int count, int node = -1) const;
+
+    // 把一段内存按页交错分布到所有节点上，已经分配的页会被迁移，只有一个节点时什么都不做
+    bool interleave(void *addr, size_t len) const;
+
+    // 解析"0,2,4-7"格式的CPU列表
+    static bool parse_cpu_list(const char *str, std::vector<int> &cpus);
+
+private:
+    struct cpu_info {
+        int cpu;        // CPU号
+        int node;       // 所在节点的下标
+        int package;    // 物理CPU（插槽）编号
+        int core;       // 物理核编号
+        int sibling;    // 是同一个物理核上的第几个超线程
+        int core_rank;  // 所在物理核是节点中的第几个物理核
+    };
+
+    struct node_info {
+        int id;                 // 内核中的节点编号
+        std::vector<int> cpus;  // 节点中可用的CPU
+    };
+
+    std::vector<cpu_info> m_cpus; // 可用的CPU，按CPU号排序
+    std::vector<node_info> m_nodes; // 有可用CPU的节点，按节点编号排序
+
+    void load_nodes();
+    void load_cores();
+    static int read_int(const char *path, int def);
+};
+
+#endif
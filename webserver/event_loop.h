@@ -0,0 +1,29 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#define MAX_FD 65535 // 最大的文件描述符个数
+#define MAX_EVENT_NUMBER 10000 // epoll监听的最大事件数量
+#define DEFAULT_ACCEPT_BUDGET 64 // 每次监听socket就绪时默认最多accept的连接数
+
+/*
+    事件后端的公共接口，启动时通过参数选择具体的实现：
+    reactor        :   基于epoll的就绪式后端，支持单反应堆和主从反应堆
+    uring_reactor  :   基于io_uring的完成式后端
+    每个对象负责一个事件循环，可以在当前线程运行，也可以单独创建一个线程运行
+*/
+class event_loop {
+public:
+    virtual ~event_loop() {}
+
+    virtual void add_listener(int lfd) = 0; // 监听socket，有监听socket的事件循环负责accept
+    virtual void set_cpu(int cpu) = 0; // 事件循环线程绑定的CPU，-1表示不绑定
+    virtual bool start() = 0; // 创建线程运行事件循环
+    virtual void run() = 0; // 在当前线程运行事件循环
+    virtual void stop() = 0; // 通知事件循环退出
+    virtual void drain() = 0; // 通知事件循环停止accept并关闭空闲的连接，用于平滑退出（跨线程调用）
+    virtual void join() = 0; // 等待事件循环线程退出
+    virtual int load() const = 0; // 当前负责的连接数
+    virtual void set_accept_budget(int budget) {} // 每次监听socket就绪时最多accept的连接数，完成式后端没有这个限制
+};
+
+#endif
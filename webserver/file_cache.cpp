@@ -0,0 +1,225 @@
+#include "file_cache.h"
+#include "http_header.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+file_cache::file_cache(int capacity, int ttl_ms) : m_ttl_ms(ttl_ms) {
+    if (capacity < 0 || ttl_ms < 0) {
+        throw std::exception();
+    }
+    m_shard_capacity = (capacity + SHARDS - 1) / SHARDS;
+}
+
+file_cache::~file_cache() {
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        while (!s.lru.empty()) {
+            unlink_entry(s, s.lru.back());
+        }
+    }
+}
+
+long file_cache::now_ms() {
+    // 只用来判断缓存项是否需要重新检查，精度要求不高，COARSE时钟不需要读硬件计数器
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char *encodings[file_cache::ENCODING_COUNT][2] = {
+    {".br", "br"},
+    {".zst", "zstd"},
+    {".gz", "gzip"},
+};
+
+const char *file_cache::encoding_suffix(int encoding) {
+    return encodings[encoding][0];
+}
+
+const char *file_cache::encoding_name(int encoding) {
+    return encodings[encoding][1];
+}
+
+const char *file_cache::mime_type(const char *path) {
+    static const char *types[][2] = {
+        {"html", "text/html"},
+        {"htm", "text/html"},
+        {"css", "text/css"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"txt", "text/plain"},
+        {"xml", "text/xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"svg", "image/svg+xml"},
+        {"ico", "image/x-icon"},
+        {"webp", "image/webp"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"pdf", "application/pdf"},
+        {"mp4", "video/mp4"},
+    };
+
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+            if (strcasecmp(dot + 1, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+// 打开文件并生成一个新的缓存项，引用计数为1（属于调用者）
+file_cache::entry *file_cache::open_entry(const char *path, int &err) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        err = errno;
+        return NULL;
+    }
+
+    entry *e = new entry;
+    e->fd = fd;
+    if (fstat(fd, &e->st) == -1) {
+        err = errno;
+    }
+    else if (S_ISDIR(e->st.st_mode)) {
+        err = EISDIR;
+    }
+    else if (!(e->st.st_mode & S_IROTH)) {
+        err = EACCES;
+    }
+    else {
+        err = 0;
+    }
+    if (err) {
+        close(fd);
+        delete e;
+        return NULL;
+    }
+
+    e->path = path;
+    e->mime = mime_type(path);
+    e->header_len = snprintf(e->header, sizeof(e->header), "Content-Length: %lld\r\nContent-Type: %s\r\n",
+                             (long long) e->st.st_size, e->mime);
+    // 文件被修改或者替换之后inode、大小、修改时间至少有一个会变化
+    e->etag_len = snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx-%llx\"", (unsigned long long) e->st.st_ino,
+                           (unsigned long long) e->st.st_size,
+                           (unsigned long long) e->st.st_mtim.tv_sec * 1000000000ULL + e->st.st_mtim.tv_nsec);
+    char last_modified[http_header::DATE_VALUE_LEN + 1];
+    http_header::format_date(last_modified, e->st.st_mtime);
+    last_modified[http_header::DATE_VALUE_LEN] = '\0';
+    e->validators_len = snprintf(e->validators, sizeof(e->validators), "Last-Modified: %s\r\nETag: %s\r\n",
+                                 last_modified, e->etag);
+    // 检查预压缩文件，比原文件旧的说明原文件更新之后没有重新压缩，不能使用
+    e->encodings = 0;
+    std::string sidecar;
+    for (int i = 0; i < ENCODING_COUNT; ++i) {
+        sidecar = path;
+        sidecar += encoding_suffix(i);
+        struct stat st;
+        if (stat(sidecar.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)
+            && st.st_mtime >= e->st.st_mtime) {
+            e->encodings |= 1u << i;
+        }
+    }
+    e->checked = now_ms();
+    e->cached = false;
+    e->refs = 1;
+    return e;
+}
+
+bool file_cache::same_file(const struct stat &a, const struct stat &b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+        && a.st_mode == b.st_mode;
+}
+
+void file_cache::unlink_entry(shard &s, entry *e) {
+    s.map.erase(e->path);
+    s.lru.erase(e->lru);
+    e->cached = false;
+    release(e); // 缓存自己持有的引用
+}
+
+file_cache::entry *file_cache::acquire(const char *path, int &err) {
+    if (m_shard_capacity == 0) {
+        return open_entry(path, err);
+    }
+
+    std::string key(path);
+    shard &s = m_shards[std::hash<std::string>()(key) % SHARDS];
+    long now = now_ms();
+
+    entry *stale = NULL;
+    s.lock.lock();
+    std::unordered_map<std::string, entry *>::iterator it = s.map.find(key);
+    if (it != s.map.end()) {
+        entry *e = it->second;
+        ++e->refs;
+        if (now - e->checked < m_ttl_ms) {
+            // 命中，不需要访问文件系统
+            s.lru.splice(s.lru.begin(), s.lru, e->lru);
+            s.lock.unlock();
+            return e;
+        }
+        stale = e;
+    }
+    s.lock.unlock();
+
+    if (stale) {
+        // 超过了ttl，在锁外重新stat，文件没有变化时继续使用
+        struct stat st;
+        bool valid = stat(path, &st) == 0 && same_file(st, stale->st);
+        s.lock.lock();
+        if (valid) {
+            stale->checked = now;
+            if (stale->cached) {
+                s.lru.splice(s.lru.begin(), s.lru, stale->lru);
+            }
+            s.lock.unlock();
+            return stale;
+        }
+        if (stale->cached) {
+            unlink_entry(s, stale);
+        }
+        s.lock.unlock();
+        release(stale);
+    }
+
+    entry *e = open_entry(path, err);
+    if (!e) {
+        return NULL;
+    }
+
+    s.lock.lock();
+    it = s.map.find(key);
+    if (it != s.map.end()) {
+        // 其他线程同时打开了同一个文件，用新打开的替换掉
+        unlink_entry(s, it->second);
+    }
+    ++e->refs; // 缓存持有的引用
+    e->cached = true;
+    s.lru.push_front(e);
+    e->lru = s.lru.begin();
+    s.map[key] = e;
+    while ((int) s.map.size() > m_shard_capacity) {
+        unlink_entry(s, s.lru.back());
+    }
+    s.lock.unlock();
+    return e;
+}
+
+void file_cache::release(entry *e) {
+    if (--e->refs == 0) {
+        close(e->fd);
+        delete e;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+    打开的文件和文件属性的缓存，以文件的完整路径为键
+    - 缓存项保存打开的fd、stat的结果、MIME类型以及预先生成好的Content-Length、Content-Type、Last-Modified、ETag头部
+    - 分成多个分片，每个分片一把锁、一个LRU链表，线程池中的线程同时查找不同的文件时很少争用同一把锁
+    - 缓存项带引用计数，被淘汰或者失效之后，正在使用它发送响应的连接仍然可以继续使用，最后一个引用释放时才关闭fd
+    - 距离上一次检查超过ttl的缓存项，下一次使用时重新stat一次，文件被修改或者替换（inode、大小、修改时间变化）时重新打开
+    - 打开文件时顺便检查同目录下预先压缩好的.br、.zst、.gz文件，只记录存在、可读并且不比原文件旧的；
+      原文件没有变化时不会重新检查，预压缩文件应该和原文件一起部署
+*/
+class file_cache {
+public:
+    static const int SHARDS = 16;
+
+    // 预压缩文件的编码，按优先级排列（压缩率高的在前）
+    enum ENCODING {ENCODING_BR = 0, ENCODING_ZSTD, ENCODING_GZIP, ENCODING_COUNT};
+    static const char *encoding_suffix(int encoding); // ".br"
+    static const char *encoding_name(int encoding); // Content-Encoding中的名字，"br"
+
+    struct entry {
+        std::string path;
+        int fd;
+        struct stat st;
+        const char *mime;
+        char header[96]; // "Content-Length: ...\r\nContent-Type: ...\r\n"
+        int header_len;
+        char etag[64]; // 强ETag，带引号，由inode、大小、修改时间生成
+        int etag_len;
+        char validators[128]; // "Last-Modified: ...\r\nETag: ...\r\n"
+        int validators_len;
+        unsigned encodings; // 存在的预压缩文件，第i位对应ENCODING中的第i种
+
+        // 下面的成员只在分片的锁内访问
+        long checked; // 上一次确认文件没有变化的时间，毫秒
+        bool cached; // 是否还在缓存中
+        std::list<entry *>::iterator lru;
+
+        std::atomic<int> refs;
+    };
+
+    // capacity为最多缓存的文件数，0表示不缓存，每次都重新打开；ttl_ms为重新检查文件的间隔
+    file_cache(int capacity, int ttl_ms = 1000);
+    ~file_cache();
+
+    /*
+        获取path对应的文件，成功时返回增加了引用计数的缓存项，用完之后调用release
+        失败时返回NULL，err为ENOENT（不存在）、EACCES（其他用户不可读）、EISDIR（是目录）或者open的错误码
+    */
+    entry *acquire(const char *path, int &err);
+    void release(entry *e);
+
+    static const char *mime_type(const char *path);
+
+private:
+    struct shard {
+        locker lock;
+        std::unordered_map<std::string, entry *> map;
+        std::list<entry *> lru; // 最近使用的在前面
+    };
+
+    shard m_shards[SHARDS];
+    int m_shard_capacity;
+    int m_ttl_ms;
+
+    static long now_ms();
+    static entry *open_entry(const char *path, int &err);
+    static bool same_file(const struct stat &a, const struct stat &b);
+    void unlink_entry(shard &s, entry *e); // 在分片的锁内把缓存项移出缓存
+};
+
+#endif
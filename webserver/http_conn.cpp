@@ -1,4 +1,5 @@
 #include "http_conn.h"
+#include "conn_timers.h"
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -11,30 +12,60 @@ const char* error_404_form = "The requested file was not found on this server.\n
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 
-// 网站的根目录
-const char* doc_root = "/root/Linux/WebServer/resources";
+namespace {
+
+// 错误响应的状态行、Content-Length和Content-Type是固定的，启动时生成一次，生成响应时直接拷贝
+struct error_page {
+    int status;
+    const char *form;
+    char header[128];
+    int header_len;
+    int form_len;
+
+    error_page(int status, const char *form) : status(status), form(form) {
+        int len;
+        const char *line = http_header::status_line(status, len);
+        memcpy(header, line, len);
+        memcpy(header + len, "Content-Length: ", 16);
+        len += 16;
+        form_len = strlen(form);
+        len += http_header::format_uint(header + len, form_len);
+        memcpy(header + len, "\r\nContent-Type: text/html\r\n", 27);
+        header_len = len + 27;
+    }
+};
 
-int http_conn::m_epollfd = -1; // 所有socket上的事件都被注册到同一个epoll对象中
-int http_conn::m_user_count = 0; // 统计用户的数量
+const error_page error_pages[] = {
+    error_page(400, error_400_form),
+    error_page(403, error_403_form),
+    error_page(404, error_404_form),
+    error_page(500, error_500_form),
+};
 
-// 设置文件描述符非阻塞
-void setnonblocking(int fd) {
-    int old_flag = fcntl(fd, F_GETFL);
-    fcntl(fd, F_SETFL, old_flag | O_NONBLOCK);
 }
 
-// 添加文件描述符到epoll中
-void addfd(int epollfd, int fd, bool one_shot) {
+// 网站的根目录
+const char* doc_root = "/root/Linux/WebServer/resources";
+
+std::atomic<int> http_conn::m_user_count(0); // 统计用户的数量
+std::atomic<bool> http_conn::m_draining(false); // 服务器正在退出
+http_conn::SEND_MODE http_conn::m_send_mode = http_conn::SEND_SENDFILE; // 发送文件内容的方式
+int http_conn::m_read_buffer_max = 32 * 1024; // 读缓冲区的上限
+file_cache *http_conn::m_file_cache = NULL; // 打开的文件和文件属性的缓存
+content_cache *http_conn::m_content_cache = NULL; // 小文件内容的缓存
+int http_conn::m_timeout_ms[http_conn::TIMEOUT_COUNT] = {60 * 1000, 15 * 1000, 60 * 1000}; // 空闲、请求头、发送的超时时间
+
+// 添加文件描述符到epoll中，edge_trigger为true时以边沿触发方式同时监听读写事件，注册之后不再修改
+// fd在创建时就已经是非阻塞的（accept4、SOCK_NONBLOCK、EFD_NONBLOCK），这里不再调用fcntl
+void addfd(int epollfd, int fd, bool edge_trigger) {
     struct epoll_event event;
     event.events = EPOLLIN | EPOLLRDHUP;
     event.data.fd = fd;
 
-    if (one_shot) {
-        event.events |= EPOLLONESHOT;
+    if (edge_trigger) {
+        event.events |= EPOLLOUT | EPOLLET;
     }
 
-    setnonblocking(fd);
-
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
 }
 
@@ -44,72 +75,240 @@ void removefd(int epollfd, int fd) {
     close(fd);
 }
 
-// 修改epoll文件描述符, 重置socket上EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
-void modfd(int epollfd, int fd, int ev) {
-    struct epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
-}
-
 // 初始化新接收的连接
-void http_conn::init(int sockfd, const struct sockaddr_in &addr) {
+void http_conn::init(int sockfd, const struct sockaddr_in &addr, int epollfd, std::atomic<int> *load, io_notifier *notifier, conn_timers *timers) {
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_load = load;
+    m_notifier = notifier;
+    m_events = 0;
+    m_busy = false;
+    m_writing = false;
+    m_served = false;
 
     int op = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
 
-    addfd(m_epollfd, m_sockfd, true);
+    if (m_epollfd != -1) {
+        addfd(m_epollfd, m_sockfd, true);
+    }
     ++m_user_count;
+    if (m_load) {
+        ++*m_load;
+    }
 
     init();
+
+    // 请求头的期限从连接建立开始计算
+    m_timeout_kind = -1;
+    if (timers) {
+        timers->attach(this);
+        update_timer();
+    }
 }
 
 // 初始化状态机相关的信息
 void http_conn::init() {
     bytes_to_send = 0;
     bytes_have_send = 0;
+    m_response_count = 0;
 
-    m_check_state = CHECK_STATE_REQUESTLINE; 
     m_checked_idx = 0;
     m_start_line = 0;
+    m_request_start = 0;
+    reset_request();
+
+    release_buffers();
+
+    m_read_idx = 0;
+    m_write_idx = 0;
+}
+
+// 重置请求行和头部字段的解析结果，准备解析下一个请求
+void http_conn::reset_request() {
+    m_check_state = CHECK_STATE_REQUESTLINE;
 
     m_method = GET;
     m_url = nullptr;
     m_version = nullptr;
 
     m_host = nullptr;
+    m_if_none_match = nullptr;
+    m_if_modified_since = nullptr;
+    m_range = nullptr;
+    m_if_range = nullptr;
+    m_accept_encoding = nullptr;
+    m_mime = nullptr;
+    m_encoding = -1;
+    m_vary = false;
     m_content_length = 0;
     m_linger = false;
+}
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
-
-    m_read_idx = 0;
+// 一批响应已经发送完，释放响应引用的文件，写缓冲区还给内存池，读缓冲区中流水线发来的数据保留
+void http_conn::finish_responses() {
+    release_responses();
+    bytes_to_send = 0;
+    bytes_have_send = 0;
     m_write_idx = 0;
+    buffer_pool::release(m_write_buf, m_write_size);
+    m_write_buf = NULL;
+    m_write_size = 0;
+}
+
+void http_conn::release_responses() {
+    for (int i = 0; i < m_response_count; ++i) {
+        response &r = m_queue->items[i];
+        if (r.mapped) {
+            munmap(r.mapped, r.file->st.st_size);
+        }
+        if (r.content) {
+            m_content_cache->release(r.content);
+        }
+        if (r.file) {
+            m_file_cache->release(r.file);
+        }
+    }
+    m_response_count = 0;
+    if (m_queue) {
+        buffer_pool::release((char *) m_queue, buffer_pool::round_up(sizeof(response_queue)));
+        m_queue = NULL;
+    }
+}
+
+// 把还没有处理完的请求数据移到读缓冲区的开头，没有剩余数据时归还读缓冲区
+void http_conn::compact_read_buf() {
+    int shift = m_request_start;
+    if (shift == 0) {
+        return;
+    }
+    if (shift == m_read_idx) {
+        m_read_idx = 0;
+        m_checked_idx = 0;
+        m_start_line = 0;
+        m_request_start = 0;
+        buffer_pool::release(m_read_buf, m_read_size);
+        m_read_buf = NULL;
+        m_read_size = 0;
+        return;
+    }
+
+    memmove(m_read_buf, m_read_buf + shift, m_read_idx - shift);
+    m_read_idx -= shift;
+    m_checked_idx -= shift;
+    m_start_line -= shift;
+    m_request_start = 0;
+    m_read_buf[m_read_idx] = '\0';
+    // 下一个请求可能已经解析了一部分
+    rebase_request(m_read_buf + shift, m_read_buf);
+}
+
+// 读缓冲区中的数据从old_base搬到了new_base，请求行和头部字段中已经解析出来的指针跟着移动
+void http_conn::rebase_request(char *old_base, char *new_base) {
+    char **fields[] = {&m_url, &m_version, &m_host, &m_if_none_match, &m_if_modified_since, &m_range, &m_if_range, &m_accept_encoding};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (*fields[i]) {
+            *fields[i] = new_base + (*fields[i] - old_base);
+        }
+    }
+}
+
+// 写缓冲区放不下下一个响应头时成倍增长，响应头用偏移量记录，不需要调整
+bool http_conn::grow_write_buf() {
+    if (m_write_size >= WRITE_BUFFER_MAX) {
+        return false;
+    }
+    int capacity;
+    char *buf = buffer_pool::acquire(m_write_size * 2, capacity);
+    if (!buf) {
+        return false;
+    }
+    memcpy(buf, m_write_buf, m_write_idx);
+    buffer_pool::release(m_write_buf, m_write_size);
+    m_write_buf = buf;
+    m_write_size = capacity;
+    return true;
+}
+
+bool http_conn::grow_read_buf(int need) {
+    int size = m_read_size ? m_read_size * 2 : READ_BUFFER_SIZE;
+    while (size < need) {
+        size *= 2;
+    }
+    if (size > m_read_buffer_max) {
+        if (need > m_read_buffer_max) {
+            return false;
+        }
+        size = m_read_buffer_max;
+    }
+
+    int capacity;
+    char *buf = buffer_pool::acquire(size, capacity);
+    if (!buf) {
+        return false;
+    }
+    // 新缓冲区不清零：解析器只访问m_read_idx之前的数据，m_read_buf[m_read_idx]总是'\0'
+    if (m_read_buf) {
+        memcpy(buf, m_read_buf, m_read_idx);
+        rebase_request(m_read_buf, buf);
+        buffer_pool::release(m_read_buf, m_read_size);
+    }
+    m_read_buf = buf;
+    m_read_size = capacity;
+    return true;
+}
+
+void http_conn::release_buffers() {
+    buffer_pool::release(m_read_buf, m_read_size);
+    m_read_buf = NULL;
+    m_read_size = 0;
+    buffer_pool::release(m_write_buf, m_write_size);
+    m_write_buf = NULL;
+    m_write_size = 0;
 }
 
 // 关闭连接
 void http_conn::close_conn() {
     if (m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        // 先清理本对象的状态再关闭fd，fd一旦关闭就可能被其他reactor线程accept复用，并重新初始化本对象
+        int sockfd = m_sockfd;
         m_sockfd = -1;
+        conn_timers *timers = m_timers;
+        if (timers) {
+            timers->detach(this);
+        }
+        unmap();
+        release_responses();
+        release_buffers();
+        if (m_pipe[0] != -1) {
+            close(m_pipe[0]);
+            close(m_pipe[1]);
+            m_pipe[0] = m_pipe[1] = -1;
+        }
         --m_user_count;
+        if (m_load) {
+            --*m_load;
+        }
+        if (m_epollfd != -1) {
+            removefd(m_epollfd, sockfd);
+        }
+        else {
+            close(sockfd);
+        }
     }
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
-    }
-
     // 读取到的字节数
     int bytes_read = 0;
     while (1) {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        // 缓冲区满了就增长，留一个字节放结尾的'\0'，超过上限时关闭连接
+        if (m_read_idx + 1 >= m_read_size && !grow_read_buf(m_read_idx + 2)) {
+            return false;
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - 1 - m_read_idx, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据
@@ -125,10 +324,25 @@ bool http_conn::read() {
         }
         else if (bytes_read > 0) {
             m_read_idx += bytes_read;
+            m_read_buf[m_read_idx] = '\0';
         }
     }
 
-    printf("读取到了数据： %s\n", m_read_buf);
+    if (m_read_idx == 0) {
+        // 没有读到数据，不占用缓冲区
+        release_buffers();
+    }
+    return true;
+}
+
+// 把完成式后端读到的数据追加到读缓冲区
+bool http_conn::feed(const char *data, int len) {
+    if (m_read_idx + len + 1 > m_read_size && !grow_read_buf(m_read_idx + len + 1)) {
+        return false;
+    }
+    memcpy(m_read_buf + m_read_idx, data, len);
+    m_read_idx += len;
+    m_read_buf[m_read_idx] = '\0';
     return true;
 }
 
@@ -139,14 +353,15 @@ http_conn::HTTP_CODE http_conn::process_read() {
 
     char *text = nullptr;
 
-    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) || ((line_status = parse_line()) == LINE_OK)) {
+    // 请求体不按行解析：请求体还没收完时不能再调用parse_line，否则m_checked_idx会越过已收到的请求体
+    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
+        || ((m_check_state != CHECK_STATE_CONTENT) && ((line_status = parse_line()) == LINE_OK))) {
         // 解析到了一行完整的数据，或者解析到了完整的请求体的数据
 
         // 获取一行数据
         text = get_line();
 
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
         switch(m_check_state) {
             case CHECK_STATE_REQUESTLINE :
                 ret = parse_request_line(text);
@@ -159,12 +374,12 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 if (ret == BAD_REQUEST) {
                     return BAD_REQUEST;
                 }
-                else if (ret = GET_REQUEST) {
+                else if (ret == GET_REQUEST) {
                     return do_request();
                 }
                 break;
             case CHECK_STATE_CONTENT :
-                ret = parse_content(text);
+                ret = parse_content();
                 if (ret == GET_REQUEST) {
                     return do_request();
                 }
@@ -179,24 +394,25 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 // 解析请求首行, 获得请求方法、目标URL、HTTP版本
+// 调用时当前行已经被parse_line截断，行尾在m_read_buf + m_checked_idx之前
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     // GET / HTTP/1.1
-    m_url = strpbrk(text, " \t");
-    if (!m_url) {
+    const char *end = m_read_buf + m_checked_idx;
+    m_url = (char *) http_parser::find_char2(text, end, ' ', '\t');
+    if (m_url == end) {
         return BAD_REQUEST;
     }
-    *m_url++ = '\0';
 
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0) {
+    if (m_url - text == 3 && strncasecmp(text, "GET", 3) == 0) {
         m_method = GET;
     }
     else {
         return BAD_REQUEST;
     }
+    *m_url++ = '\0';
 
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version) {
+    m_version = (char *) http_parser::find_char2(m_url, end, ' ', '\t');
+    if (m_version == end) {
         return BAD_REQUEST;
     }
     *m_version++ = '\0';
@@ -230,70 +446,196 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text );
+    }
+
+    // 字段名到冒号为止，行尾已经被替换成了'\0'，同时查找'\0'就不会越过这一行
+    char *colon = (char *) http_parser::find_char2(text, m_read_buf + m_checked_idx, ':', '\0');
+    if (*colon != ':') {
+        // 没有冒号的行直接忽略
+        return NO_REQUEST;
+    }
+    char *value = colon + 1;
+    value += strspn( value, " \t" );
+
+    switch (http_parser::lookup_header(text, colon - text)) {
+        case http_parser::HEADER_CONNECTION :
+            // 处理Connection 头部字段  Connection: keep-alive
+            if ( strcasecmp( value, "keep-alive" ) == 0 ) {
+                m_linger = true;
+            }
+            break;
+        case http_parser::HEADER_CONTENT_LENGTH :
+            // 处理Content-Length头部字段，负数、非数字或者超过读缓冲区上限的值都会让解析位置越界
+            {
+                char *end;
+                errno = 0;
+                long long length = strtoll( value, &end, 10 );
+                end += strspn( end, " \t" );
+                if ( end == value || *end != '\0' || errno == ERANGE || length < 0
+                    || length > m_read_buffer_max ) {
+                    return BAD_REQUEST;
+                }
+                m_content_length = (int) length;
+            }
+            break;
+        case http_parser::HEADER_HOST :
+            // 处理Host头部字段
+            m_host = value;
+            break;
+        case http_parser::HEADER_IF_NONE_MATCH :
+            m_if_none_match = value;
+            break;
+        case http_parser::HEADER_IF_MODIFIED_SINCE :
+            m_if_modified_since = value;
+            break;
+        case http_parser::HEADER_RANGE :
+            m_range = value;
+            break;
+        case http_parser::HEADER_IF_RANGE :
+            m_if_range = value;
+            break;
+        case http_parser::HEADER_ACCEPT_ENCODING :
+            m_accept_encoding = value;
+            break;
+        default :
+            // 其他字段暂时不处理
+            break;
     }
     return NO_REQUEST;
 }
 
 // 解析请求体,我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+http_conn::HTTP_CODE http_conn::parse_content() {
+    if ( m_read_idx - m_checked_idx >= m_content_length )
     {
-        text[ m_content_length ] = '\0';
+        // 跳过请求体，后面可能紧跟着流水线发来的下一个请求，不能在请求体末尾写'\0'
+        m_checked_idx += m_content_length;
+        m_start_line = m_checked_idx; // 下一个请求的首行从请求体之后开始
         return GET_REQUEST;
     }
     return NO_REQUEST;
 }
 
 // 从状态机的解析某一行, 判断依据\r\n
+// 用http_parser::find_line_end一次跳过16或32个普通字符，找到\r或\n之后的判断和逐字节扫描时一样
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
-        temp = m_read_buf[m_checked_idx];
-        if (temp == '\r') {
-            if ((m_checked_idx + 1) == m_read_idx) {
-                return LINE_OPEN;
+    if (m_checked_idx >= m_read_idx) {
+        return LINE_OPEN;
+    }
+    const char *end = m_read_buf + m_read_idx;
+    m_checked_idx = http_parser::find_line_end(m_read_buf + m_checked_idx, end) - m_read_buf;
+    if (m_checked_idx >= m_read_idx) {
+        return LINE_OPEN;
+    }
+
+    if (m_read_buf[m_checked_idx] == '\r') {
+        if ((m_checked_idx + 1) == m_read_idx) {
+            return LINE_OPEN;
+        }
+        else if (m_read_buf[m_checked_idx + 1] == '\n') {
+            m_read_buf[m_checked_idx++] = '\0';
+            m_read_buf[m_checked_idx++] = '\0'; 
+            return LINE_OK;               
+        }
+        return LINE_BAD;
+    }
+
+    // '\n'
+    if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
+        m_read_buf[m_checked_idx - 1] = '\0';
+        m_read_buf[m_checked_idx++] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
+}
+
+// 解析Range中的一个偏移量，超过2^62时当作格式错误
+static bool parse_offset( const char *&p, off_t &value ) {
+    if ( *p < '0' || *p > '9' ) {
+        return false;
+    }
+    value = 0;
+    while ( *p >= '0' && *p <= '9' ) {
+        if ( value > ( ( off_t ) 1 << 62 ) / 10 ) {
+            return false;
+        }
+        value = value * 10 + ( *p++ - '0' );
+    }
+    return true;
+}
+
+/*
+    解析Range字段（"bytes=0-499, 1000-, -200"），可以满足的范围按出现的顺序存入ranges，都是闭区间，结束位置不超过文件末尾
+    返回范围数，没有可以满足的范围时返回0；格式不对、不是bytes单位或者范围超过max个时返回-1，这时忽略Range发送整个文件
+*/
+static int parse_ranges( const char *p, off_t size, off_t ranges[][2], int max ) {
+    if ( strncasecmp( p, "bytes=", 6 ) != 0 ) {
+        return -1;
+    }
+    p += 6;
+    int count = 0;
+    while ( 1 ) {
+        p += strspn( p, " \t" );
+        off_t start = -1;
+        off_t end = -1;
+        if ( *p != '-' && !parse_offset( p, start ) ) {
+            return -1;
+        }
+        if ( *p++ != '-' ) {
+            return -1;
+        }
+        if ( *p >= '0' && *p <= '9' && !parse_offset( p, end ) ) {
+            return -1;
+        }
+        p += strspn( p, " \t" );
+        if ( *p != ',' && *p != '\0' ) {
+            return -1;
+        }
+
+        bool satisfiable;
+        if ( start < 0 ) {
+            // "-n"：最后n个字节
+            if ( end < 0 ) {
+                return -1;
             }
-            else if (m_read_buf[m_checked_idx + 1] == '\n') {
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0'; 
-                return LINE_OK;               
+            satisfiable = end > 0 && size > 0;
+            start = end >= size ? 0 : size - end;
+            end = size - 1;
+        }
+        else {
+            if ( end >= 0 && end < start ) {
+                return -1;
             }
-            else {
-                return LINE_BAD;
+            satisfiable = start < size;
+            if ( end < 0 || end >= size ) {
+                end = size - 1;
             }
         }
-        else if (temp == '\n') {
-            if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            else {
-                return LINE_BAD;
+        if ( satisfiable ) {
+            if ( count == max ) {
+                return -1;
             }
+            ranges[count][0] = start;
+            ranges[count][1] = end;
+            ++count;
         }
+
+        if ( *p == '\0' ) {
+            return count;
+        }
+        ++p;
     }
+}
 
-    return LINE_OPEN;
+// multipart/byteranges的分隔串，每个线程从启动时间开始递增
+static int make_boundary( char *buf ) {
+    static thread_local unsigned long long counter = 0;
+    if ( counter == 0 ) {
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        counter = ( unsigned long long ) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    return http_header::format_uint( buf, ++counter );
 }
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
@@ -301,112 +643,458 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 // 映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request() {
     // "/home/nowcoder/webserver/resources"
-    strcpy( m_real_file, doc_root );
+    char real_file[ FILENAME_LEN ];
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+    memcpy( real_file, doc_root, len );
+    // strncpy会把剩下的空间全部填0，只拷贝需要的部分
+    int url_len = strnlen( m_url, FILENAME_LEN - len - 1 );
+    memcpy( real_file + len, m_url, url_len );
+    real_file[ len + url_len ] = '\0';
+    // 从缓存中取得打开的文件和它的状态信息，缓存命中时不需要访问文件系统
+    int err = 0;
+    m_file = m_file_cache->acquire( real_file, err );
+    if ( !m_file ) {
+        if ( err == EACCES ) {
+            // 没有访问权限
+            return FORBIDDEN_REQUEST;
+        }
+        if ( err == EISDIR ) {
+            // 是目录
+            return BAD_REQUEST;
+        }
+        if ( err == EMFILE || err == ENFILE || err == ENOMEM ) {
+            return INTERNAL_ERROR;
+        }
         return NO_RESOURCE;
     }
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    if ( m_file->encodings ) {
+        // 有预压缩文件时，响应的内容取决于Accept-Encoding，不论是否使用都要告诉缓存
+        m_vary = true;
+        if ( m_accept_encoding ) {
+            select_encoding( real_file, len + url_len );
+        }
     }
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
-        return BAD_REQUEST;
+    if ( not_modified() ) {
+        // 客户端的缓存仍然有效，不需要读取文件内容
+        return NOT_MODIFIED;
+    }
+
+    if ( m_range ) {
+        off_t ranges[ MAX_RANGES ][ 2 ];
+        int count = if_range_match() ? parse_ranges( m_range, m_file->st.st_size, ranges, MAX_RANGES ) : -1;
+        if ( count == 0 ) {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        if ( count < 0 ) {
+            // 格式不对、范围太多或者If-Range不匹配（文件已经变了），发送整个文件
+            m_range = NULL;
+        }
+    }
+
+    if ( m_content_cache ) {
+        // 小文件直接从内存中发送
+        m_content = m_content_cache->acquire( m_file->path.c_str(), m_file->st, m_file->fd );
+        if ( m_content ) {
+            return FILE_REQUEST;
+        }
     }
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
+    if ( m_send_mode != SEND_MMAP && !m_notifier ) {
+        // 发送时由内核直接从m_file->fd的页缓存读取
+        return FILE_REQUEST;
+    }
+    if ( m_file->st.st_size == 0 ) {
+        // 空文件不能mmap（EINVAL），只发送响应头
+        return FILE_REQUEST;
+    }
     // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    m_file_address = ( char* )mmap( 0, m_file->st.st_size, PROT_READ, MAP_PRIVATE, m_file->fd, 0 );
+    if ( m_file_address == MAP_FAILED ) {
+        m_file_address = 0;
+        unmap();
+        return INTERNAL_ERROR;
+    }
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
+// If-None-Match中是否有和etag匹配的项，按弱比较，W/前缀不影响结果
+static bool etag_match( const char *list, const char *etag, int etag_len ) {
+    const char *p = list;
+    while ( *p ) {
+        p += strspn( p, " \t," );
+        if ( *p == '*' ) {
+            return true;
+        }
+        if ( strncmp( p, "W/", 2 ) == 0 ) {
+            p += 2;
+        }
+        if ( *p != '"' ) {
+            // 格式错误，不再继续匹配
+            return false;
+        }
+        const char *end = strchr( p + 1, '"' );
+        if ( !end ) {
+            return false;
+        }
+        ++end;
+        if ( end - p == etag_len && memcmp( p, etag, etag_len ) == 0 ) {
+            return true;
+        }
+        p = end;
+    }
+    return false;
+}
+
+/*
+    根据条件请求的头部判断m_file是否没有变化
+    有If-None-Match时只看ETag，忽略If-Modified-Since；If-Modified-Since的日期格式不对时当作没有这个字段
+*/
+bool http_conn::not_modified() const {
+    if ( m_if_none_match ) {
+        return etag_match( m_if_none_match, m_file->etag, m_file->etag_len );
+    }
+    if ( m_if_modified_since ) {
+        long since;
+        if ( http_header::parse_date( m_if_modified_since, since ) ) {
+            return m_file->st.st_mtime <= since;
+        }
+    }
+    return false;
+}
+
+/*
+    Accept-Encoding中客户端接受的预压缩编码，第i位对应file_cache::ENCODING中的第i种
+    "gzip, deflate, br;q=0.9, zstd;q=0"：q为0表示不接受，其余的q值不影响选择，总是优先使用压缩率高的编码
+*/
+static unsigned accepted_encodings( const char *p ) {
+    unsigned mask = 0;
+    while ( *p ) {
+        p += strspn( p, " \t," );
+        int name_len = strcspn( p, " \t,;" );
+        const char *name = p;
+        p += name_len;
+
+        // 参数中只关心q=0
+        bool rejected = false;
+        while ( *p && *p != ',' ) {
+            p += strspn( p, " \t;" );
+            if ( ( p[0] == 'q' || p[0] == 'Q' ) && p[1] == '=' ) {
+                const char *q = p + 2;
+                rejected = ( q[0] == '0' ) && strspn( q + 1, ".0" ) == strcspn( q + 1, " \t,;" );
+            }
+            p += strcspn( p, ",;" );
+        }
+        if ( rejected || name_len == 0 ) {
+            continue;
+        }
+        if ( name_len == 1 && name[0] == '*' ) {
+            mask |= ( 1u << file_cache::ENCODING_COUNT ) - 1;
+            continue;
+        }
+        for ( int i = 0; i < file_cache::ENCODING_COUNT; ++i ) {
+            const char *encoding = file_cache::encoding_name( i );
+            if ( ( int ) strlen( encoding ) == name_len && strncasecmp( name, encoding, name_len ) == 0 ) {
+                mask |= 1u << i;
+            }
+        }
+    }
+    return mask;
+}
+
+/*
+    在客户端接受的预压缩文件中选择优先级最高的一个替换m_file，real_file为原文件的路径，长度为len
+    预压缩文件打不开（比如刚被删除）时试下一个，都不行时继续使用原文件
+*/
+void http_conn::select_encoding( char *real_file, int len ) {
+    unsigned usable = m_file->encodings & accepted_encodings( m_accept_encoding );
+    for ( int i = 0; i < file_cache::ENCODING_COUNT && usable; ++i ) {
+        if ( !( usable & ( 1u << i ) ) ) {
+            continue;
+        }
+        const char *suffix = file_cache::encoding_suffix( i );
+        int suffix_len = strlen( suffix );
+        if ( len + suffix_len >= FILENAME_LEN ) {
+            return;
+        }
+        memcpy( real_file + len, suffix, suffix_len + 1 );
+        int err;
+        file_cache::entry *sidecar = m_file_cache->acquire( real_file, err );
+        real_file[ len ] = '\0';
+        if ( sidecar ) {
+            // Content-Type仍然是原文件的类型
+            m_mime = m_file->mime;
+            m_encoding = i;
+            m_file_cache->release( m_file );
+            m_file = sidecar;
+            return;
+        }
+    }
+}
+
+// If-Range为ETag时和文件的ETag完全相同（强比较），为日期时和Last-Modified完全相同，才发送部分内容
+bool http_conn::if_range_match() const {
+    if ( !m_if_range ) {
+        return true;
+    }
+    if ( m_if_range[0] == '"' ) {
+        return strcmp( m_if_range, m_file->etag ) == 0;
+    }
+    long date;
+    return http_header::parse_date( m_if_range, date ) && date == m_file->st.st_mtime;
+}
+
+// 释放当前请求的目标文件（还没有交给响应队列时）：对内存映射区执行munmap操作，并把文件内容和文件交还给缓存
 void http_conn::unmap() {
     if( m_file_address )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        munmap( m_file_address, m_file->st.st_size );
         m_file_address = 0;
     }
+    if ( m_content ) {
+        m_content_cache->release( m_content );
+        m_content = NULL;
+    }
+    if ( m_file ) {
+        m_file_cache->release( m_file );
+        m_file = NULL;
+    }
+}
+
+// 把一段数据中还没有发送的部分加入iovec，skip是还需要跳过的已发送字节数
+static void push_iov(struct iovec *iov, int &count, off_t &skip, char *base, off_t len) {
+    if (skip >= len) {
+        skip -= len;
+        return;
+    }
+    iov[count].iov_base = base + skip;
+    iov[count].iov_len = len - skip;
+    ++count;
+    skip = 0;
+}
+
+/*
+    按照已经发送的字节数，把队列中还没有发送的响应头和内存中的文件内容依次填入m_queue->iov，
+    遇到需要sendfile、splice发送的文件内容时停止，返回这一段的下标，fd_sent为这一段已经发送的字节数；
+    后面没有这样的段时返回-1
+*/
+int http_conn::fill_iov(off_t &fd_sent) {
+    off_t skip = bytes_have_send;
+    m_iv_count = 0;
+    for (int i = 0; i < m_response_count; ++i) {
+        response &r = m_queue->items[i];
+        push_iov(m_queue->iov, m_iv_count, skip, m_write_buf + r.header_off, r.header_len);
+        if (r.body_len == 0) {
+            continue;
+        }
+        if (!r.body) {
+            if (skip < r.body_len) {
+                fd_sent = skip;
+                return i;
+            }
+            skip -= r.body_len;
+            continue;
+        }
+        push_iov(m_queue->iov, m_iv_count, skip, (char *) r.body, r.body_len);
+    }
+    return -1;
+}
+
+/*
+    发送一部分响应，返回发送的字节数，出错时返回-1并设置errno
+    队列中连续的响应头和内存中的文件内容用一次sendmsg发出，后面紧跟着需要sendfile、splice发送的文件内容时带上MSG_MORE，
+    让内核把它们和文件的第一段合并成满的TCP段；文件内容发完之后再继续发送后面的响应
+    发送进度只由已经发送的字节数决定，socket缓冲区满了返回EAGAIN之后，下一次从断开的地方继续
+*/
+int http_conn::send_responses() {
+    off_t fd_sent = 0;
+    int fd_item = fill_iov( fd_sent );
+    if ( m_iv_count > 0 ) {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = m_queue->iov;
+        msg.msg_iovlen = m_iv_count;
+        return sendmsg( m_sockfd, &msg, MSG_NOSIGNAL | ( fd_item >= 0 ? MSG_MORE : 0 ) );
+    }
+
+    const response &r = m_queue->items[ fd_item ];
+    off_t offset = r.body_off + fd_sent;
+    off_t remain = r.body_len - fd_sent;
+    if ( m_send_mode == SEND_SENDFILE ) {
+        int ret = sendfile( m_sockfd, r.body_fd, &offset, remain );
+        if ( ret == 0 ) {
+            // 文件在发送过程中被截短了，已经发不出声明的长度
+            errno = EIO;
+            return -1;
+        }
+        return ret;
+    }
+
+    if ( m_pipe[0] == -1 && pipe2( m_pipe, O_NONBLOCK | O_CLOEXEC ) == -1 ) {
+        return -1;
+    }
+    if ( m_pipe_size == 0 ) {
+        // 管道空了才从文件中接着读入一段，这时offset正好是管道中数据之后的位置
+        int ret = splice( r.body_fd, &offset, m_pipe[1], NULL, remain, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( ret <= 0 ) {
+            // 空管道不会返回EAGAIN，不能让调用者把它当成socket缓冲区满而等待EPOLLOUT
+            if ( ret == 0 || errno == EAGAIN ) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        m_pipe_size = ret;
+    }
+    int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    if ( bytes_to_send > m_pipe_size ) {
+        flags |= SPLICE_F_MORE;
+    }
+    int ret = splice( m_pipe[0], NULL, m_sockfd, NULL, m_pipe_size, flags );
+    if ( ret > 0 ) {
+        m_pipe_size -= ret;
+    }
+    return ret;
 }
 
-// 非阻塞的写,写HTTP响应
-bool http_conn::write() {
+// 非阻塞的写,写HTTP响应，直到写完或者TCP写缓冲没有空间
+http_conn::WRITE_STATUS http_conn::write() {
     int temp = 0;
     
     if ( bytes_to_send == 0 ) {
         // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
+        finish_responses();
+        return WRITE_DONE_KEEP;
     }
 
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        temp = send_responses();
         if ( temp <= -1 ) {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
+            // 如果TCP写缓冲没有空间，则等待下一次EPOLLOUT边沿，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
+                return WRITE_MORE;
             }
-            unmap();
-            return false;
+            return WRITE_DONE_CLOSE;
         }
 
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
-
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+        WRITE_STATUS status = advance_write(temp);
+        if (status != WRITE_MORE) {
+            // 没有数据要发送了
+            return status;
         }
+    }
+}
 
-        if (bytes_to_send <= 0)
-        {
-            // 没有数据要发送了
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
+// 尝试成为连接的所有者，同一时刻只有一个线程（reactor线程或者线程池中的线程）推进连接的读写
+bool http_conn::try_own() {
+    bool expected = false;
+    return m_busy.compare_exchange_strong(expected, true);
+}
 
-            if (m_linger)
-            {
-                init();
-                return true;
+/*
+    由连接的所有者调用，根据reactor记录下来的就绪事件推进连接：
+    有待发送的响应时在可写的情况下发送响应，否则在可读的情况下读取数据
+    IO_PROCESS  :   读到了新数据，需要调用process()，所有权仍然归调用者
+    IO_IDLE     :   暂时无法推进，所有权已经交还，之后的事件由reactor线程重新驱动
+    IO_CLOSED   :   连接已经关闭
+*/
+http_conn::IO_RESULT http_conn::drive() {
+    bool progress = false;
+    while (1) {
+        int events = m_events;
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            // 对方异常断开或者错误等事件
+            close_conn();
+            return IO_CLOSED;
+        }
+
+        bool writing = m_writing;
+        if (writing && (events & EPOLLOUT)) {
+            // 先清除可写标记再写，写的过程中到达的新边沿会重新设置它
+            m_events &= ~EPOLLOUT;
+            off_t sent = bytes_have_send;
+            WRITE_STATUS status = write();
+            if (status == WRITE_DONE_CLOSE) {
+                close_conn();
+                return IO_CLOSED;
             }
-            else
-            {
-                return false;
+            if (status == WRITE_DONE_KEEP) {
+                // 没有遇到EAGAIN，socket仍然可写
+                m_events |= EPOLLOUT;
+                m_writing = false;
+                if (m_read_idx > 0) {
+                    // 读缓冲区中还有流水线发来的数据，不需要等待新的EPOLLIN
+                    return IO_PROCESS;
+                }
+                continue;
             }
+            // 写出了数据，发送超时重新计时
+            progress = progress || bytes_have_send != sent;
+        }
+        else if (!writing && (events & EPOLLIN)) {
+            m_events &= ~EPOLLIN;
+            if (!read()) {
+                close_conn();
+                return IO_CLOSED;
+            }
+            return IO_PROCESS;
         }
 
+        // 交还所有权，之后再检查一次在交还之前到达的事件，避免事件丢失
+        update_timer(progress);
+        progress = false;
+        m_busy = false;
+        int wanted = (writing ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+        if (!(m_events & wanted) || !try_own()) {
+            return IO_IDLE;
+        }
     }
+}
 
-    return true;
+void http_conn::update_timer(bool restart) {
+    conn_timers *timers = m_timers;
+    if (!timers) {
+        return;
+    }
+    int kind = TIMEOUT_IDLE;
+    if (m_response_count > 0) {
+        kind = TIMEOUT_WRITE;
+    }
+    else if (m_read_idx > 0 || !m_served) {
+        kind = TIMEOUT_HEADER;
+    }
+    // 同一个阶段不延长期限，慢速发送请求头的客户端不能靠零碎的数据续期
+    if (kind == m_timeout_kind && !restart) {
+        return;
+    }
+    m_timeout_kind = kind;
+    timers->arm(this, m_timeout_ms[kind]);
+}
+
+// 已经写出len个字节，更新发送进度，整批响应发送完毕时释放它们引用的文件，根据最后一个响应决定是否保持连接
+http_conn::WRITE_STATUS http_conn::advance_write(int len) {
+    bytes_have_send += len;
+    bytes_to_send -= len;
+
+    if (bytes_to_send > 0) {
+        return WRITE_MORE;
+    }
+
+    bool keep = m_queue->items[m_response_count - 1].linger;
+    finish_responses();
+    return keep ? WRITE_DONE_KEEP : WRITE_DONE_CLOSE;
 }
 
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
+    if( m_write_idx >= m_write_size ) {
         return false;
     }
     va_list arg_list;
     va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    int len = vsnprintf( m_write_buf + m_write_idx, m_write_size - 1 - m_write_idx, format, arg_list );
+    if( len >= ( m_write_size - 1 - m_write_idx ) ) {
         return false;
     }
     m_write_idx += len;
@@ -414,110 +1102,432 @@ bool http_conn::add_response( const char* format, ... ) {
     return true;
 }
 
+// 往写缓冲中拷贝一段预先生成好的数据，响应头都由这样的片段拼成，空间不够时增长写缓冲区
+bool http_conn::add_bytes( const char* data, int len ) {
+    while( m_write_idx + len >= m_write_size ) {
+        if ( !grow_write_buf() ) {
+            return false;
+        }
+    }
+    memcpy( m_write_buf + m_write_idx, data, len );
+    m_write_idx += len;
+    return true;
+}
+
 bool http_conn::add_status_line( int status, const char* title ) {
+    int len;
+    const char *line = http_header::status_line( status, len );
+    if ( line ) {
+        return add_bytes( line, len );
+    }
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
 bool http_conn::add_headers(int content_len) {
     add_content_length(content_len);
     add_content_type();
+    add_date();
     add_linger();
-    add_blank_line();
-    return true;
+    return add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+bool http_conn::add_content_length(off_t content_len) {
+    char buf[16 + http_header::UINT_MAX_LEN + 2];
+    memcpy( buf, "Content-Length: ", 16 );
+    int len = 16 + http_header::format_uint( buf + 16, content_len );
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return add_bytes( buf, len );
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    if ( m_linger ) {
+        return add_bytes( "Connection: keep-alive\r\n", 24 );
+    }
+    return add_bytes( "Connection: close\r\n", 19 );
+}
+
+bool http_conn::add_date()
+{
+    return add_bytes( http_header::date(), http_header::DATE_LEN );
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return add_bytes( "\r\n", 2 );
 }
 
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
+    return add_bytes( content, strlen( content ) );
 }
 
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_bytes( "Content-Type: text/html\r\n", 25 );
+}
+
+bool http_conn::add_content_type( const char* mime ) {
+    add_bytes( "Content-Type: ", 14 );
+    add_bytes( mime, strlen( mime ) );
+    return add_bytes( "\r\n", 2 );
+}
+
+// 使用了预压缩文件时的Content-Encoding，以及有预压缩文件时的Vary
+bool http_conn::add_encoding() {
+    if ( m_encoding >= 0 ) {
+        const char *name = file_cache::encoding_name( m_encoding );
+        add_bytes( "Content-Encoding: ", 18 );
+        add_bytes( name, strlen( name ) );
+        add_bytes( "\r\n", 2 );
+    }
+    if ( m_vary ) {
+        return add_bytes( "Vary: Accept-Encoding\r\n", 23 );
+    }
+    return true;
+}
+
+bool http_conn::add_accept_ranges() {
+    return add_bytes( "Accept-Ranges: bytes\r\n", 22 );
+}
+
+// Content-Range: bytes start-end/size，start小于0时为bytes */size
+bool http_conn::add_content_range( off_t start, off_t end, off_t size ) {
+    char buf[ 21 + http_header::UINT_MAX_LEN * 3 + 4 ];
+    memcpy( buf, "Content-Range: bytes ", 21 );
+    int len = 21;
+    if ( start < 0 ) {
+        buf[ len++ ] = '*';
+    }
+    else {
+        len += http_header::format_uint( buf + len, start );
+        buf[ len++ ] = '-';
+        len += http_header::format_uint( buf + len, end );
+    }
+    buf[ len++ ] = '/';
+    len += http_header::format_uint( buf + len, size );
+    buf[ len++ ] = '\r';
+    buf[ len++ ] = '\n';
+    return add_bytes( buf, len );
+}
+
+// 错误响应：预先生成的状态行和实体头部、Date、Connection，然后是错误页面
+bool http_conn::add_error_page( int status ) {
+    for ( size_t i = 0; i < sizeof( error_pages ) / sizeof( error_pages[0] ); ++i ) {
+        const error_page &page = error_pages[i];
+        if ( page.status == status ) {
+            response &r = push_item();
+            add_bytes( page.header, page.header_len );
+            add_date();
+            add_linger();
+            add_blank_line();
+            if ( ! add_bytes( page.form, page.form_len ) ) {
+                return false;
+            }
+            finish_item( r, 0, 0 );
+            return true;
+        }
+    }
+    return false;
+}
+
+// 在队列末尾开始一段待发送的数据，这一段的响应头从写缓冲区的当前位置开始
+http_conn::response &http_conn::push_item() {
+    response &r = m_queue->items[m_response_count++];
+    r.header_off = m_write_idx;
+    r.header_len = 0;
+    r.body = NULL;
+    r.body_fd = -1;
+    r.body_off = 0;
+    r.body_len = 0;
+    r.file = NULL;
+    r.content = NULL;
+    r.mapped = NULL;
+    r.linger = m_linger;
+    return r;
+}
+
+// 结束一段：记下响应头的长度，消息体为目标文件的[off, off + len)，len为0时没有消息体
+void http_conn::finish_item(response &r, off_t off, off_t len) {
+    r.header_len = m_write_idx - r.header_off;
+    if ( len > 0 ) {
+        if ( m_content ) {
+            r.body = m_content->data + off;
+        }
+        else if ( m_file_address ) {
+            r.body = m_file_address + off;
+        }
+        else {
+            // 发送时由内核直接从页缓存读取
+            r.body_fd = m_file->fd;
+            r.body_off = off;
+        }
+        r.body_len = len;
+    }
+    bytes_to_send += r.header_len + len;
+}
+
+// 200：整个文件
+bool http_conn::add_file() {
+    response &r = push_item();
+    add_status_line( 200, ok_200_title );
+    if ( m_encoding < 0 ) {
+        // Content-Length和Content-Type已经在文件缓存中生成好了
+        add_bytes( m_file->header, m_file->header_len );
+    }
+    else {
+        add_content_length( m_file->st.st_size );
+        add_content_type( m_mime );
+    }
+    add_encoding();
+    add_bytes( m_file->validators, m_file->validators_len );
+    add_accept_ranges();
+    add_date();
+    add_linger();
+    if ( ! add_blank_line() ) {
+        return false;
+    }
+    finish_item( r, 0, m_file->st.st_size );
+    return true;
 }
 
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+/*
+    206：文件的一个或者多个范围，do_request已经确认至少有一个可以满足的范围
+    一个范围时消息体直接是文件的这一段；多个范围时为multipart/byteranges，每个范围一段，
+    各段的分隔行和头部在写缓冲区中，文件内容和整个文件时一样从内存或者用sendfile、splice发送
+*/
+bool http_conn::add_ranges() {
+    off_t ranges[ MAX_RANGES ][ 2 ];
+    off_t size = m_file->st.st_size;
+    int count = parse_ranges( m_range, size, ranges, MAX_RANGES );
+
+    if ( count == 1 ) {
+        response &r = push_item();
+        add_status_line( 206, "Partial Content" );
+        add_content_length( ranges[0][1] - ranges[0][0] + 1 );
+        add_content_range( ranges[0][0], ranges[0][1], size );
+        add_content_type( m_mime ? m_mime : m_file->mime );
+        add_encoding();
+        add_bytes( m_file->validators, m_file->validators_len );
+        add_accept_ranges();
+        add_date();
+        add_linger();
+        if ( ! add_blank_line() ) {
+            return false;
+        }
+        finish_item( r, ranges[0][0], ranges[0][1] - ranges[0][0] + 1 );
+        return true;
+    }
+
+    char boundary[ http_header::UINT_MAX_LEN ];
+    int boundary_len = make_boundary( boundary );
+    // 第一段是响应头，Content-Length要等后面各段的头部生成之后才知道，先占住位置
+    response &head = push_item();
+    off_t body_len = 0;
+    for ( int i = 0; i < count; ++i ) {
+        response &part = push_item();
+        add_bytes( "\r\n--", 4 );
+        add_bytes( boundary, boundary_len );
+        add_bytes( "\r\n", 2 );
+        add_content_type( m_mime ? m_mime : m_file->mime );
+        add_content_range( ranges[i][0], ranges[i][1], size );
+        if ( ! add_blank_line() ) {
+            return false;
+        }
+        finish_item( part, ranges[i][0], ranges[i][1] - ranges[i][0] + 1 );
+        body_len += part.header_len + part.body_len;
+    }
+    response &tail = push_item();
+    add_bytes( "\r\n--", 4 );
+    add_bytes( boundary, boundary_len );
+    if ( ! add_bytes( "--\r\n", 4 ) ) {
+        return false;
+    }
+    finish_item( tail, 0, 0 );
+    body_len += tail.header_len;
+
+    head.header_off = m_write_idx;
+    add_status_line( 206, "Partial Content" );
+    add_bytes( "Content-Type: multipart/byteranges; boundary=", 45 );
+    add_bytes( boundary, boundary_len );
+    add_bytes( "\r\n", 2 );
+    add_content_length( body_len );
+    add_encoding();
+    add_bytes( m_file->validators, m_file->validators_len );
+    add_accept_ranges();
+    add_date();
+    add_linger();
+    if ( ! add_blank_line() ) {
+        return false;
+    }
+    finish_item( head, 0, 0 );
+    return true;
+}
+
+// 304：没有消息体，只带上验证用的Last-Modified和ETag
+bool http_conn::add_not_modified() {
+    response &r = push_item();
+    add_status_line( 304, "Not Modified" );
+    add_encoding();
+    add_bytes( m_file->validators, m_file->validators_len );
+    add_date();
+    add_linger();
+    if ( ! add_blank_line() ) {
+        return false;
+    }
+    finish_item( r, 0, 0 );
+    return true;
+}
+
+// 416：Range中没有可以满足的范围，告诉客户端文件的大小
+bool http_conn::add_range_not_satisfiable() {
+    response &r = push_item();
+    add_status_line( 416, "Range Not Satisfiable" );
+    add_content_range( -1, -1, m_file->st.st_size );
+    add_content_length( 0 );
+    add_accept_ranges();
+    add_date();
+    add_linger();
+    if ( ! add_blank_line() ) {
+        return false;
+    }
+    finish_item( r, 0, 0 );
+    return true;
+}
+
+// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容，生成的响应加入待发送的队列
 bool http_conn::process_write(HTTP_CODE ret) {
+    if (m_draining) {
+        // 服务器正在退出，发完这个响应就关闭连接，客户端会在新的连接上发送下一个请求
+        m_linger = false;
+    }
+    if (ret == BAD_REQUEST) {
+        // 请求格式错误时无法确定下一个请求从哪里开始
+        m_linger = false;
+    }
+    m_served = true;
+    // 请求已经完整，之后进入发送阶段，流水线中的下一个请求重新计算请求头的期限
+    m_timeout_kind = -1;
+
+    if ( !m_write_buf ) {
+        m_write_buf = buffer_pool::acquire( WRITE_BUFFER_SIZE, m_write_size );
+        if ( !m_write_buf ) {
+            unmap();
+            return false;
+        }
+    }
+    if ( !m_queue ) {
+        int capacity;
+        m_queue = ( response_queue * ) buffer_pool::acquire( sizeof( response_queue ), capacity );
+        if ( !m_queue ) {
+            unmap();
+            return false;
+        }
+    }
+
+    int first = m_response_count;
+    bool ok = false;
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
-            }
+            ok = add_error_page( 500 );
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
-            }
+            ok = add_error_page( 400 );
             break;
         case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
-            }
+            ok = add_error_page( 404 );
             break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
-                return false;
-            }
+            ok = add_error_page( 403 );
             break;
         case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            ok = m_range ? add_ranges() : add_file();
+            break;
+        case NOT_MODIFIED:
+            ok = add_not_modified();
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            ok = add_range_not_satisfiable();
+            break;
+        default:
+            break;
+    }
+    if ( !ok ) {
+        unmap();
+        return false;
+    }
 
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+    // 文件交给这个响应的第一段，整批发送完之后释放
+    response &r = m_queue->items[ first ];
+    r.file = m_file;
+    r.content = m_content;
+    r.mapped = m_file_address;
+    m_file = NULL;
+    m_content = NULL;
+    m_file_address = NULL;
+
+    // 下一个请求从这里开始
+    m_request_start = m_checked_idx;
+    reset_request();
+    return true;
+}
 
-            return true;
-        default:
+/*
+    解析读缓冲区中所有完整的请求（流水线），生成的响应依次加入队列，之后一起发送
+    遇到不保持连接的响应或者队列满了时停止，剩下的请求在这一批发送完之后再处理
+    返回false表示生成响应失败，需要关闭连接
+*/
+bool http_conn::process_requests() {
+    while (m_response_count < MAX_PIPELINE) {
+        if (m_response_count > 0) {
+            if (!m_queue->items[m_response_count - 1].linger) {
+                break;
+            }
+            if (m_write_size - m_write_idx < MIN_WRITE_SPACE && !grow_write_buf()) {
+                break;
+            }
+        }
+
+        // 解析HTTP请求
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST) {
+            break;
+        }
+        // 生成响应
+        if (!process_write(read_ret)) {
             return false;
+        }
     }
-
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    compact_read_buf();
     return true;
 }
 
 // 处理客户端请求
 void http_conn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
-    }
+    while (1) {
+        bool ok = process_requests();
+        if (m_notifier) {
+            if (!ok) {
+                m_notifier->notify(this, io_notifier::WANT_CLOSE);
+            }
+            else {
+                m_notifier->notify(this, m_response_count > 0 ? io_notifier::WANT_WRITE : io_notifier::WANT_READ);
+            }
+            return;
+        }
 
-    // 生成响应
-    bool write_ret = process_write(read_ret);
-    if (!write_ret) {
-        close_conn();
-    }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+        if (!ok) {
+            close_conn();
+            return;
+        }
+        if (m_response_count > 0) {
+            m_writing = true;
+        }
 
+        // 在当前线程直接发送响应，并处理期间到达的新数据，不需要再经过reactor
+        if (drive() != IO_PROCESS) {
+            return;
+        }
+    }
 }
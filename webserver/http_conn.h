@@ -17,15 +17,41 @@
 #include <errno.h>
 #include <string.h>
 #include "locker.h"
+#include "http_parser.h"
+#include "http_header.h"
+#include "file_cache.h"
+#include "content_cache.h"
+#include "buffer_pool.h"
+#include "timer_node.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <atomic>
+
+class http_conn;
+class conn_timers;
+
+// 完成式的事件后端（io_uring）不通过epoll得知读写就绪，由它自己提交读写操作，
+// 请求处理完之后通过这个接口告诉后端接下来要读、要写还是要关闭连接
+class io_notifier {
+public:
+    enum IO_WANT {WANT_READ = 0, WANT_WRITE, WANT_CLOSE};
+
+    virtual ~io_notifier() {}
+    virtual void notify(http_conn *conn, IO_WANT want) = 0;
+};
 
 class http_conn {
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static int m_epollfd; // 所有socket上的事件都被注册到同一个epoll对象中
-    static int m_user_count; // 统计用户的数量
-    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+    static std::atomic<int> m_user_count; // 统计用户的数量
+    static std::atomic<bool> m_draining; // 服务器正在退出，之后的响应都不再保持连接
+    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的初始大小，请求更大时成倍增长
+    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的初始大小，一批响应放不下时成倍增长
+    static const int WRITE_BUFFER_MAX = 16 * 1024; // 写缓冲区的上限
+    static const int MIN_WRITE_SPACE = 512; // 写缓冲区剩余空间少于这个值时，先增长再生成下一个响应
+    static const int MAX_PIPELINE = 16; // 一批最多发送的响应数
+    static const int MAX_RANGES = 8; // 一个请求最多的范围数，超过时发送整个文件
+    static int m_read_buffer_max; // 读缓冲区最大可以增长到的大小，超过时关闭连接，是buffer_pool的等级大小
 
     // HTTP请求方法，但我们只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -50,52 +76,168 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求，获取文件成功
+        NOT_MODIFIED        :   条件请求，客户端缓存的文件没有变化，只返回304
+        RANGE_NOT_SATISFIABLE   :   Range中没有落在文件范围内的
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
+    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, INTERNAL_ERROR, CLOSED_CONNECTION};
+
+    // 写出一部分数据之后的发送状态：还有数据要发送、发送完毕保持连接、发送完毕或者出错需要关闭连接
+    enum WRITE_STATUS {WRITE_MORE = 0, WRITE_DONE_KEEP, WRITE_DONE_CLOSE};
 
-    http_conn() {}
+    /*
+        连接所处的阶段，每个阶段有自己的超时时间，超过时由事件循环关闭连接
+        TIMEOUT_IDLE    :   处理完请求之后，等待下一个请求的保持连接
+        TIMEOUT_HEADER  :   从连接建立或者前一个请求处理完开始，到收到完整的请求头为止，零碎地发送数据不会延长期限
+        TIMEOUT_WRITE   :   发送响应，每次有进展（写出了数据）时重新计时
+    */
+    enum TIMEOUT_KIND {TIMEOUT_IDLE = 0, TIMEOUT_HEADER, TIMEOUT_WRITE, TIMEOUT_COUNT};
+    static int m_timeout_ms[TIMEOUT_COUNT]; // 各个阶段的超时时间，单位毫秒，0表示不限制
+
+    // 所有者推进连接之后的结果，见drive()
+    enum IO_RESULT {IO_IDLE = 0, IO_PROCESS, IO_CLOSED};
+
+    /*
+        发送文件内容的方式
+        SEND_MMAP       :   mmap文件之后和响应头一起writev，每个请求一次mmap和munmap
+        SEND_SENDFILE   :   响应头用send(MSG_MORE)发出，文件内容用sendfile从页缓存直接发送
+        SEND_SPLICE     :   响应头同上，文件内容经过每个连接自己的管道splice到socket
+        完成式后端（io_uring）的写操作需要内存中的数据，总是使用SEND_MMAP
+    */
+    enum SEND_MODE {SEND_MMAP = 0, SEND_SENDFILE, SEND_SPLICE};
+    static SEND_MODE m_send_mode;
+    static file_cache *m_file_cache; // 打开的文件和文件属性的缓存，由main创建，所有连接共享
+    static content_cache *m_content_cache; // 小文件内容的缓存，NULL表示不使用
+
+    http_conn() : m_epollfd(-1), m_sockfd(-1), m_read_buf(NULL), m_read_size(0), m_write_buf(NULL), m_write_size(0),
+        m_file_address(NULL), m_file(NULL), m_content(NULL), m_queue(NULL), m_timers(NULL), m_timeout_kind(-1) { m_pipe[0] = m_pipe[1] = -1; }
     ~http_conn() {}
 
     // 处理客户端请求
     void process();
-    void init(int sockfd, const struct sockaddr_in &addr); // 初始化新接收的连接
+    // 初始化新接收的连接，epollfd为-1时表示连接由notifier对应的完成式后端负责读写，timers为NULL时不限制超时
+    void init(int sockfd, const struct sockaddr_in &addr, int epollfd, std::atomic<int> *load, io_notifier *notifier = NULL, conn_timers *timers = NULL);
     void close_conn(); // 关闭连接
     bool read(); // 非阻塞的读
-    bool write(); // 非阻塞的写
+    WRITE_STATUS write(); // 非阻塞的写
+
+    // 下面这一组函数供epoll后端使用，fd以边沿触发方式注册一次，之后不再修改，就绪事件记录在m_events中
+    void add_events(int events) { m_events |= events; } // reactor线程记录就绪事件
+    bool try_own(); // 尝试成为连接的所有者
+    IO_RESULT drive(); // 所有者根据就绪事件推进连接的读写
+
+    // 下面这一组函数供完成式后端使用，数据由后端读写，http_conn只负责解析请求和维护发送进度
+    bool feed(const char *data, int len); // 把后端读到的数据追加到读缓冲区
+    struct iovec *get_iov(int &count) { off_t fd_sent; fill_iov(fd_sent); count = m_iv_count; return m_queue->iov; } // 待发送的数据，完成式后端总是使用mmap
+    WRITE_STATUS advance_write(int len); // 后端写出len个字节之后更新发送进度
+    bool get_linger() const { return m_response_count > 0 ? m_queue->items[m_response_count - 1].linger : m_linger; } // 这一批响应发送完之后是否保持连接
+    bool has_pending_input() const { return m_read_idx > 0; } // 读缓冲区中是否还有没有处理的数据（流水线发来的请求）
+    int get_sockfd() const { return m_sockfd; }
+    int get_epollfd() const { return m_epollfd; }
+    // 已经处理过请求、正在等待下一个请求的保持连接，只能在拥有连接时调用
+    // 刚accept还没有发来请求的连接不算空闲，它的请求可能正在路上
+    bool idle() const { return m_served && m_read_idx == 0 && !m_writing; }
+    // 按照连接所处的阶段设置定时器，阶段没有变化时不延长期限，restart为true时重新计时，只能在拥有连接时调用
+    void update_timer(bool restart = false);
 
 private:
+    friend class conn_timers;
+
+    /*
+        待发送的一段数据：写缓冲区中的一段响应头，后面可能跟着一段文件内容
+        一个响应通常只有一段，multipart/byteranges响应的每个范围各占一段
+    */
+    struct response {
+        int header_off; // 响应头在m_write_buf中的位置
+        int header_len;
+        const char *body; // 内存中的文件内容（内容缓存或者mmap），NULL时用sendfile、splice从body_fd发送
+        int body_fd;
+        off_t body_off; // body_fd方式下文件内容在文件中的偏移量
+        off_t body_len; // 文件内容的长度，没有时为0
+        // 发送完之后要释放的资源，只记录在一个响应的第一段上
+        file_cache::entry *file;
+        content_cache::entry *content;
+        char *mapped; // mmap的起始位置，长度为整个文件
+        bool linger; // 所在的响应发送完之后是否保持连接
+    };
+
+    // 响应队列，生成第一个响应时从buffer_pool中申请，整批发送完之后归还
+    // 少于MAX_PIPELINE段时才会处理下一个请求，一个请求最多占MAX_RANGES + 2段
+    static const int QUEUE_SIZE = MAX_PIPELINE + MAX_RANGES + 1;
+    struct response_queue {
+        response items[QUEUE_SIZE];
+        struct iovec iov[QUEUE_SIZE * 2];
+    };
+
+    int m_epollfd; // 该连接所属reactor的epoll对象
+    std::atomic<int> *m_load; // 所属reactor的连接计数
+    io_notifier *m_notifier; // 完成式后端，epoll后端为NULL
+    std::atomic<int> m_events; // reactor记录下来的尚未处理的就绪事件
+    std::atomic<bool> m_busy; // 是否有线程正在推进该连接
+    bool m_writing; // 是否有待发送的响应，只由所有者访问
+    bool m_served; // 是否已经生成过响应
     int m_sockfd; // 该HTTP连接的客户端socket
     struct sockaddr_in m_address; // 通信的socket地址
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    // 读写缓冲区在需要时从buffer_pool中申请，响应发送完之后归还，空闲的保持连接不占用缓冲区
+    char *m_read_buf; // 读缓冲区
+    int m_read_size; // 读缓冲区的大小
     int m_read_idx; // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
 
     int m_checked_idx; // 当前正在分析的字符在读缓冲区的位置
     int m_start_line; // 当前正在解析的行的起始位置
+    int m_request_start; // 当前正在解析的请求的起始位置，之前的请求都已经生成了响应
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     METHOD m_method; // 请求方法
     char *m_url; // 目标URL
     char *m_version; // 协议版本，只支持HTTP1.1
 
     char *m_host; // 请求头中的主机名
+    char *m_if_none_match; // 请求头中的If-None-Match，客户端缓存的ETag列表
+    char *m_if_modified_since; // 请求头中的If-Modified-Since
+    char *m_range; // 请求头中的Range，do_request确定不发送部分内容时置为NULL
+    char *m_if_range; // 请求头中的If-Range
+    char *m_accept_encoding; // 请求头中的Accept-Encoding
+    const char *m_mime; // 使用预压缩文件时原文件的MIME类型
+    int m_encoding; // 使用的预压缩文件的编码，见file_cache::ENCODING，-1表示使用原文件
+    bool m_vary; // 目标文件有预压缩文件，响应中需要Vary: Accept-Encoding
     int m_content_length;                   // HTTP请求的消息总长度
     bool m_linger; // 请求头中的Connection 是否保持连接 
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
+    char *m_write_buf;                      // 写缓冲区
+    int m_write_size;                       // 写缓冲区的大小
     int m_write_idx;                        // 写缓冲区中待发送的字节数
+    // do_request的结果，生成响应时交给响应队列
     char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
+    file_cache::entry *m_file;              // 从文件缓存中取得的目标文件
+    content_cache::entry *m_content;        // 从内容缓存中取得的文件内容，命中时不再mmap或者sendfile
+    int m_pipe[2];                          // splice方式使用的管道，第一次使用时创建，连接关闭时释放
+    int m_pipe_size;                        // 已经从文件读进管道、还没有写到socket的字节数
+    response_queue *m_queue;                // 待发送的响应
+    int m_response_count;                   // 队列中的段数
+    int m_iv_count;                         // m_queue->iov中有效的项数
+
+    timer_node m_timer;                     // 超时定时器，由m_timers管理，不单独分配
+    std::atomic<conn_timers *> m_timers;    // 定时器所在的时间轮，连接关闭之后为NULL
+    int m_timeout_kind;                     // 定时器对应的阶段，-1表示还没有设置
 
-    int bytes_to_send;              // 将要发送的数据的字节数
-    int bytes_have_send;            // 已经发送的字节数
+    off_t bytes_to_send;              // 将要发送的数据的字节数
+    off_t bytes_have_send;            // 已经发送的字节数
 
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
 
     void init(); // 初始化状态机相关的信息
+    bool grow_read_buf(int need); // 读缓冲区增长到至少need字节，已经读到的数据和指向它的指针都搬到新的缓冲区
+    void release_buffers(); // 把读写缓冲区归还给buffer_pool
+    void reset_request(); // 重置请求的解析结果，准备解析下一个请求
+    void compact_read_buf(); // 把没有处理完的数据移到读缓冲区开头
+    void rebase_request(char *old_base, char *new_base); // 读缓冲区中的数据搬动之后调整指向它的指针
+    bool grow_write_buf(); // 写缓冲区成倍增长
+    bool process_requests(); // 解析读缓冲区中所有完整的请求，生成一批响应
+    void finish_responses(); // 一批响应发送完之后的清理
+    void release_responses(); // 释放响应队列和响应引用的文件
+    int fill_iov(off_t &fd_sent); // 按发送进度填充m_queue->iov
+    int send_responses(); // 发送一部分响应，返回值和writev一样
 
     HTTP_CODE process_read(); // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
@@ -103,20 +245,36 @@ private:
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line(char *text); // 解析请求首行
     HTTP_CODE parse_headers(char *text); // 解析请求头
-    HTTP_CODE parse_content(char *text); // 解析请求体
+    HTTP_CODE parse_content(); // 解析请求体
     HTTP_CODE do_request();
+    bool not_modified() const; // 条件请求的条件是否成立（客户端缓存的文件仍然有效）
+    bool if_range_match() const; // If-Range是否允许发送部分内容
+    void select_encoding( char *real_file, int len ); // 按Accept-Encoding选择预压缩文件
     LINE_STATUS parse_line(); // 从状态机的解析某一行
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
     bool add_response( const char* format, ... );
+    bool add_bytes( const char* data, int len );
     bool add_content( const char* content );
     bool add_content_type();
+    bool add_content_type( const char* mime );
+    bool add_encoding();
     bool add_status_line( int status, const char* title );
     bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_content_length( off_t content_length );
     bool add_linger();
     bool add_blank_line();
+    bool add_date();
+    bool add_error_page( int status );
+    bool add_accept_ranges();
+    bool add_content_range( off_t start, off_t end, off_t size );
+    response &push_item(); // 在队列末尾开始一段
+    void finish_item( response &r, off_t off, off_t len ); // 结束一段，消息体为目标文件的[off, off + len)
+    bool add_file();
+    bool add_ranges();
+    bool add_not_modified();
+    bool add_range_not_satisfiable();
 
     char *get_line() { return m_read_buf + m_start_line; }
 };
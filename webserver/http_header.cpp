@@ -0,0 +1,149 @@
+#include "http_header.h"
+#include <string.h>
+#include <time.h>
+
+namespace {
+
+// 00 ~ 99的两位数字
+const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+const char *day_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+const char *month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+struct date_cache {
+    long seconds;
+    char line[http_header::DATE_LEN + 1];
+
+    date_cache() : seconds(-1) {
+        memcpy(line, "Date: ", 6);
+        memcpy(line + 35, "\r\n", 3);
+    }
+};
+
+thread_local date_cache t_date;
+
+inline void put2(char *p, int value) {
+    memcpy(p, digit_pairs + value * 2, 2);
+}
+
+// 解析两位数字，不是数字时返回-1
+inline int get2(const char *p) {
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') {
+        return -1;
+    }
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+}
+
+#define STATUS_LINE(s) len = sizeof(s) - 1; return s
+
+const char *http_header::status_line(int status, int &len) {
+    switch (status) {
+        case 200: STATUS_LINE("HTTP/1.1 200 OK\r\n");
+        case 206: STATUS_LINE("HTTP/1.1 206 Partial Content\r\n");
+        case 304: STATUS_LINE("HTTP/1.1 304 Not Modified\r\n");
+        case 400: STATUS_LINE("HTTP/1.1 400 Bad Request\r\n");
+        case 403: STATUS_LINE("HTTP/1.1 403 Forbidden\r\n");
+        case 404: STATUS_LINE("HTTP/1.1 404 Not Found\r\n");
+        case 416: STATUS_LINE("HTTP/1.1 416 Range Not Satisfiable\r\n");
+        case 500: STATUS_LINE("HTTP/1.1 500 Internal Error\r\n");
+        default:
+            len = 0;
+            return NULL;
+    }
+}
+
+int http_header::format_uint(char *buf, unsigned long long value) {
+    // 先从低位往高位写到临时缓冲区的末尾，再整体拷贝
+    char tmp[UINT_MAX_LEN];
+    char *p = tmp + UINT_MAX_LEN;
+    while (value >= 100) {
+        p -= 2;
+        put2(p, value % 100);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        put2(p, value);
+    }
+    else {
+        *--p = '0' + value;
+    }
+    int len = tmp + UINT_MAX_LEN - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+void http_header::format_date(char *buf, long seconds) {
+    time_t t = seconds;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    memcpy(buf, day_names[tm.tm_wday], 3);
+    memcpy(buf + 3, ", ", 2);
+    put2(buf + 5, tm.tm_mday);
+    buf[7] = ' ';
+    memcpy(buf + 8, month_names[tm.tm_mon], 3);
+    buf[11] = ' ';
+    int year = tm.tm_year + 1900;
+    put2(buf + 12, year / 100);
+    put2(buf + 14, year % 100);
+    buf[16] = ' ';
+    put2(buf + 17, tm.tm_hour);
+    buf[19] = ':';
+    put2(buf + 20, tm.tm_min);
+    buf[22] = ':';
+    put2(buf + 23, tm.tm_sec);
+    memcpy(buf + 25, " GMT", 4);
+}
+
+const char *http_header::date() {
+    // COARSE时钟读的是内核每个tick更新的时间，不需要读硬件计数器
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != t_date.seconds) {
+        t_date.seconds = ts.tv_sec;
+        format_date(t_date.line + 6, ts.tv_sec);
+    }
+    return t_date.line;
+}
+
+bool http_header::parse_date(const char *p, long &seconds) {
+    // "Sun, 06 Nov 1994 08:49:37 GMT"，星期几不参与计算
+    if (strnlen(p, DATE_VALUE_LEN) < (size_t) DATE_VALUE_LEN || p[3] != ',' || p[4] != ' ' || p[7] != ' '
+        || p[11] != ' ' || p[16] != ' ' || p[19] != ':' || p[22] != ':' || memcmp(p + 25, " GMT", 4) != 0) {
+        return false;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; ++i) {
+        if (memcmp(p + 8, month_names[i], 3) == 0) {
+            tm.tm_mon = i;
+            break;
+        }
+    }
+    int century = get2(p + 12);
+    int year = get2(p + 14);
+    tm.tm_mday = get2(p + 5);
+    tm.tm_hour = get2(p + 17);
+    tm.tm_min = get2(p + 20);
+    tm.tm_sec = get2(p + 23);
+    if (tm.tm_mon < 0 || century < 0 || year < 0 || tm.tm_mday < 1 || tm.tm_hour < 0 || tm.tm_min < 0 || tm.tm_sec < 0) {
+        return false;
+    }
+    tm.tm_year = century * 100 + year - 1900;
+    seconds = timegm(&tm);
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+/*
+    生成HTTP响应头用到的预先生成好的片段，生成响应头只需要依次memcpy几段，不再调用vsnprintf
+    - 状态行是常量字符串
+    - 整数转十进制每次处理两位，查表得到两个字符
+    - Date字段每个线程缓存一份，秒数变化之后第一次使用时重新生成，一秒最多格式化一次
+*/
+class http_header {
+public:
+    static const int DATE_LEN = 37; // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    static const int DATE_VALUE_LEN = 29; // "Sun, 06 Nov 1994 08:49:37 GMT"
+    static const int UINT_MAX_LEN = 20; // 64位无符号整数最多20位
+
+    // 状态码对应的状态行（包括\r\n），不支持的状态码返回NULL
+    static const char *status_line(int status, int &len);
+
+    // 把value以十进制写到buf中，不写结尾的'\0'，返回写入的字节数，buf至少要有UINT_MAX_LEN个字节
+    static int format_uint(char *buf, unsigned long long value);
+
+    // 当前时间的Date字段（包括\r\n），长度为DATE_LEN，指向线程自己的缓存
+    static const char *date();
+
+    // 把秒数格式化成HTTP日期（"Sun, 06 Nov 1994 08:49:37 GMT"，29个字节），不写结尾的'\0'
+    static void format_date(char *buf, long seconds);
+
+    // 解析format_date格式的日期（IMF-fixdate），不是这个格式时返回false
+    static bool parse_date(const char *p, long &seconds);
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "http_parser.h"
+#include <string.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86
+#endif
+
+static const char *find_char2_scalar(const char *p, const char *end, char a, char b) {
+    for (; p < end; ++p) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef HTTP_PARSER_X86
+// SSE4.2的pcmpestri一次在16个字节中查找字符集合（这里是a和b）中的任意一个
+__attribute__((target("sse4.2")))
+static const char *find_char2_sse42(const char *p, const char *end, char a, char b) {
+    const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int idx = _mm_cmpestri(set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return p + idx;
+        }
+        p += 16;
+    }
+    return find_char2_scalar(p, end, a, b);
+}
+
+// AVX2一次比较32个字节，两次比较的结果合并成一个32位的掩码，最低的1就是第一个匹配的位置
+__attribute__((target("avx2")))
+static const char *find_char2_avx2(const char *p, const char *end, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_char2_sse42(p, end, a, b);
+}
+#endif
+
+http_parser::find_char2_func http_parser::s_find_char2 = http_parser::resolve_find_char2;
+http_parser::SIMD_LEVEL http_parser::s_level = http_parser::SIMD_SCALAR;
+
+http_parser::SIMD_LEVEL http_parser::detect() {
+#ifdef HTTP_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SIMD_SSE42;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+const char *http_parser::resolve_find_char2(const char *p, const char *end, char a, char b) {
+    set_level(detect());
+    return s_find_char2(p, end, a, b);
+}
+
+void http_parser::set_level(SIMD_LEVEL level) {
+    SIMD_LEVEL supported = detect();
+    if (level > supported) {
+        level = supported;
+    }
+    // 多个线程可能同时第一次调用，写入的都是同一个值
+    s_level = level;
+    switch (level) {
+#ifdef HTTP_PARSER_X86
+        case SIMD_AVX2 :
+            s_find_char2 = find_char2_avx2;
+            break;
+        case SIMD_SSE42 :
+            s_find_char2 = find_char2_sse42;
+            break;
+#endif
+        default :
+            s_find_char2 = find_char2_scalar;
+            break;
+    }
+}
+
+http_parser::SIMD_LEVEL http_parser::level() {
+    if (s_find_char2 == resolve_find_char2) {
+        set_level(detect());
+    }
+    return s_level;
+}
+
+const char *http_parser::level_name(SIMD_LEVEL level) {
+    switch (level) {
+        case SIMD_AVX2 :
+            return "avx2";
+        case SIMD_SSE42 :
+            return "sse4.2";
+        default :
+            return "scalar";
+    }
+}
+
+/*
+    完美哈希：slot = (长度 + 4 * 首字母 + 尾字母) & 63，字母先转成小写（| 0x20）
+    这组参数让下面所有已知字段名落在不同的槽里，查找时算出槽号后只需要和这一个字段名比较一次
+    增加字段名时需要重新选择参数，保证没有冲突
+*/
+#define HEADER_SLOTS 64
+
+static inline unsigned header_slot(const char *name, int len) {
+    return (len + 4 * (name[0] | 0x20) + (name[len - 1] | 0x20)) & (HEADER_SLOTS - 1);
+}
+
+namespace {
+
+struct header_entry {
+    const char *name;
+    int len;
+    http_parser::HEADER_NAME id;
+};
+
+struct header_table {
+    header_entry slots[HEADER_SLOTS];
+
+    header_table() {
+        static const header_entry known[] = {
+            {"Host", 4, http_parser::HEADER_HOST},
+            {"Connection", 10, http_parser::HEADER_CONNECTION},
+            {"Content-Length", 14, http_parser::HEADER_CONTENT_LENGTH},
+            {"Content-Type", 12, http_parser::HEADER_CONTENT_TYPE},
+            {"Accept", 6, http_parser::HEADER_ACCEPT},
+            {"Accept-Encoding", 15, http_parser::HEADER_ACCEPT_ENCODING},
+            {"Accept-Language", 15, http_parser::HEADER_ACCEPT_LANGUAGE},
+            {"User-Agent", 10, http_parser::HEADER_USER_AGENT},
+            {"Cookie", 6, http_parser::HEADER_COOKIE},
+            {"Referer", 7, http_parser::HEADER_REFERER},
+            {"Cache-Control", 13, http_parser::HEADER_CACHE_CONTROL},
+            {"If-Modified-Since", 17, http_parser::HEADER_IF_MODIFIED_SINCE},
+            {"If-None-Match", 13, http_parser::HEADER_IF_NONE_MATCH},
+            {"If-Match", 8, http_parser::HEADER_IF_MATCH},
+            {"If-Unmodified-Since", 19, http_parser::HEADER_IF_UNMODIFIED_SINCE},
+            {"Range", 5, http_parser::HEADER_RANGE},
+            {"If-Range", 8, http_parser::HEADER_IF_RANGE},
+            {"Pragma", 6, http_parser::HEADER_PRAGMA},
+            {"Upgrade", 7, http_parser::HEADER_UPGRADE},
+            {"Origin", 6, http_parser::HEADER_ORIGIN},
+            {"Authorization", 13, http_parser::HEADER_AUTHORIZATION},
+            {"Transfer-Encoding", 17, http_parser::HEADER_TRANSFER_ENCODING},
+            {"Expect", 6, http_parser::HEADER_EXPECT},
+            {"Keep-Alive", 10, http_parser::HEADER_KEEP_ALIVE},
+        };
+        memset(slots, 0, sizeof(slots));
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); ++i) {
+            slots[header_slot(known[i].name, known[i].len)] = known[i];
+        }
+    }
+};
+
+const header_table g_header_table;
+
+}
+
+http_parser::HEADER_NAME http_parser::lookup_header(const char *name, int len) {
+    if (len <= 0) {
+        return HEADER_UNKNOWN;
+    }
+    const header_entry &entry = g_header_table.slots[header_slot(name, len)];
+    if (entry.len == len && strncasecmp(entry.name, name, len) == 0) {
+        return entry.id;
+    }
+    return HEADER_UNKNOWN;
+}
@@ -0,0 +1,67 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+/*
+    HTTP请求解析用到的扫描函数
+    - 查找分隔符（行尾的\r\n、请求行中的空格、头部字段中的冒号）时一次比较16或32个字节，
+      启动后第一次调用时根据CPU选择AVX2、SSE4.2或者逐字节的实现
+    - 头部字段名通过完美哈希映射到枚举值，不需要和每个已知字段名逐个strncasecmp
+*/
+class http_parser {
+public:
+    // 查找分隔符使用的指令集
+    enum SIMD_LEVEL {SIMD_SCALAR = 0, SIMD_SSE42, SIMD_AVX2};
+
+    // 服务器关心的头部字段，其余的都是HEADER_UNKNOWN
+    enum HEADER_NAME {
+        HEADER_UNKNOWN = 0,
+        HEADER_HOST,
+        HEADER_CONNECTION,
+        HEADER_CONTENT_LENGTH,
+        HEADER_CONTENT_TYPE,
+        HEADER_ACCEPT,
+        HEADER_ACCEPT_ENCODING,
+        HEADER_ACCEPT_LANGUAGE,
+        HEADER_USER_AGENT,
+        HEADER_COOKIE,
+        HEADER_REFERER,
+        HEADER_CACHE_CONTROL,
+        HEADER_IF_MODIFIED_SINCE,
+        HEADER_IF_NONE_MATCH,
+        HEADER_IF_MATCH,
+        HEADER_IF_UNMODIFIED_SINCE,
+        HEADER_RANGE,
+        HEADER_IF_RANGE,
+        HEADER_PRAGMA,
+        HEADER_UPGRADE,
+        HEADER_ORIGIN,
+        HEADER_AUTHORIZATION,
+        HEADER_TRANSFER_ENCODING,
+        HEADER_EXPECT,
+        HEADER_KEEP_ALIVE,
+        HEADER_COUNT
+    };
+
+    // 返回[p, end)中第一个等于a或者b的字节的位置，没有时返回end
+    static const char *find_char2(const char *p, const char *end, char a, char b) { return s_find_char2(p, end, a, b); }
+    // 返回[p, end)中第一个\r或者\n的位置，没有时返回end
+    static const char *find_line_end(const char *p, const char *end) { return s_find_char2(p, end, '\r', '\n'); }
+
+    // 头部字段名（不区分大小写）对应的枚举值
+    static HEADER_NAME lookup_header(const char *name, int len);
+
+    static SIMD_LEVEL level();
+    static void set_level(SIMD_LEVEL level); // 强制使用某个实现，用于测试和对比，CPU不支持时退回到能用的最高级别
+    static const char *level_name(SIMD_LEVEL level);
+
+private:
+    typedef const char *(*find_char2_func)(const char *, const char *, char, char);
+
+    static find_char2_func s_find_char2; // 当前使用的实现，初始值在第一次调用时检测CPU并替换自己
+    static SIMD_LEVEL s_level;
+
+    static const char *resolve_find_char2(const char *p, const char *end, char a, char b);
+    static SIMD_LEVEL detect();
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "listener_handoff.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool make_addr(const char *path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+bool listener_handoff::receive(const char *path, std::vector<int> &fds) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, addr)) {
+        return false;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return false;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        // 没有旧进程在运行
+        ::close(sock);
+        return false;
+    }
+
+    // 正文是监听socket的个数，监听socket本身在控制消息中
+    int count = 0;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+    ::close(sock);
+    if (ret != sizeof(count)) {
+        perror("recvmsg");
+        return false;
+    }
+
+    fds.clear();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *data = (int *) CMSG_DATA(cmsg);
+            for (int i = 0; i < n; ++i) {
+                fds.push_back(data[i]);
+            }
+        }
+    }
+    return (int) fds.size() == count;
+}
+
+bool listener_handoff::listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, addr)) {
+        return false;
+    }
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd == -1) {
+        perror("socket");
+        return false;
+    }
+    unlink(path);
+    if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || ::listen(m_fd, 1) == -1) {
+        perror("bind control socket");
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool listener_handoff::send(const std::vector<int> &fds) {
+    int sock = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        return false;
+    }
+
+    int count = fds.size() < (size_t) MAX_FDS ? fds.size() : MAX_FDS;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * count);
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    ::close(sock);
+    if (ret != sizeof(count)) {
+        perror("sendmsg");
+        return false;
+    }
+    return true;
+}
+
+void listener_handoff::close() {
+    if (m_fd != -1) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef LISTENER_HANDOFF_H
+#define LISTENER_HANDOFF_H
+
+#include <vector>
+
+/*
+    不停机升级：新旧进程之间通过Unix域socket传递监听socket（SCM_RIGHTS）
+    1. 旧进程在控制路径上监听（listen）
+    2. 新进程启动时先连接控制路径（receive），旧进程把所有的监听socket发过来，新进程直接使用，不需要重新bind
+    3. 旧进程发送完之后停止accept，处理完已有的连接后退出；新进程删除控制路径并重新监听，等待下一次升级
+    监听socket在两个进程之间是同一个内核对象，监听队列中的连接不会丢失
+*/
+class listener_handoff {
+public:
+    static const int MAX_FDS = 64; // 一次最多传递的监听socket数量
+
+    listener_handoff() : m_fd(-1) {}
+    ~listener_handoff() { close(); }
+
+    // 新进程调用：连接旧进程的控制路径，接收监听socket，没有旧进程时返回false
+    static bool receive(const char *path, std::vector<int> &fds);
+
+    // 在控制路径上监听，原来的路径文件会被删除
+    bool listen(const char *path);
+    // 控制socket可读时调用：接受新进程的连接，把监听socket发过去
+    bool send(const std::vector<int> &fds);
+    // 关闭控制socket，不删除路径文件（它可能已经属于新进程）
+    void close();
+
+    int get_fd() const { return m_fd; }
+
+private:
+    int m_fd; // 控制socket
+};
+
+#endif
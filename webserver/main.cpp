@@ -10,12 +10,21 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/signalfd.h>
+#include <getopt.h>
+#include <linux/filter.h>
+#include <vector>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65535 // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // epoll监听的最大事件数量
+#include "event_loop.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "stats.h"
+#include "cpu_topology.h"
+#include "listener_handoff.h"
 
 // 添加信号捕捉
 void addsig(int sig, void (handler)(int)) {
@@ -26,46 +35,23 @@ void addsig(int sig, void (handler)(int)) {
     sigaction(sig, &sa, NULL);
 }
 
-// 添加文件描述符到epoll中
-extern void addfd(int epollfd, int fd, bool one_shot);
-// 从epoll中删除文件描述符
-extern void removefd(int epollfd, int fd);
-// 修改epoll文件描述符, 重置socket上EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
-extern void modfd(int epollfd, int fd, int ev);
-
-int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("按照如下格式运行： %s port_number\n", basename(argv[0]));
-        exit(-1);
-    }
-
-    // 获取端口号
-    int port = atoi(argv[1]);
-
-    // 对 SIGPIPE 信号进行处理
-    addsig(SIGPIPE, SIG_IGN);
-
-    // 创建线程池，初始化线程池
-    threadpool<http_conn> *pool = NULL;
-    try {
-        pool = new threadpool<http_conn>;
-    } catch(...) {
-        exit(-1);
-    }
-
-    // 创建一个数组用于保存所有的客户端信息
-    http_conn *users = new http_conn[MAX_FD];
-
-    // 创建监听的套接字
-    int lfd = socket(PF_INET, SOCK_STREAM, 0);
+// 创建监听的套接字，reuseport为true时设置SO_REUSEPORT，多个socket可以绑定同一个端口，由内核分发新连接
+int create_listener(int port, bool reuseport, int backlog) {
+    // 监听socket是非阻塞的，每次就绪时循环accept直到EAGAIN
+    int lfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (lfd == -1) {
         perror("socket");
-        exit(-1);
+        return -1;
     }
 
     // 设置端口复用
     int op = 1;
     setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
+    if (reuseport && setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &op, sizeof(op)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(lfd);
+        return -1;
+    }
 
     // 绑定
     struct sockaddr_in saddr;
@@ -75,74 +61,530 @@ int main(int argc, char *argv[]) {
     int ret = bind(lfd, (struct sockaddr *)&saddr, sizeof(saddr));
     if (ret == -1) {
         perror("bind");
-        exit(-1);
+        close(lfd);
+        return -1;
     }
 
     // 监听
-    ret = listen(lfd, 5);
+    ret = listen(lfd, backlog);
     if (ret == -1) {
         perror("listen");
-        exit(-1);
+        close(lfd);
+        return -1;
     }
 
-    // 创建epoll对象
-    int epollfd = epoll_create(5);
-    struct epoll_event epevs[MAX_EVENT_NUMBER];
+    return lfd;
+}
+
+// 优先使用从旧进程继承的监听socket，没有时新建
+int take_listener(std::vector<int> &inherited, int port, bool reuseport, int backlog) {
+    if (!inherited.empty()) {
+        int lfd = inherited.front();
+        inherited.erase(inherited.begin());
+        return lfd;
+    }
+    return create_listener(port, reuseport, backlog);
+}
 
-    // 将监听的文件描述符添加到epoll对象中
-    addfd(epollfd, lfd, false);
+/*
+    给SO_REUSEPORT组挂一个经典BPF程序：返回值是组内socket的下标，这里用收到数据包的CPU号对分片数取模，
+    配合分片线程绑定到对应的CPU上，新连接就会由收包的那个核上的分片来accept和处理
+*/
+bool attach_cpu_steering(int lfd, int shard_number) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) }, // A = 当前CPU号
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)shard_number },            // A = A % shard_number
+        { BPF_RET | BPF_A, 0, 0, 0 },                                         // 返回A
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(lfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
 
-    http_conn::m_epollfd = epollfd;
+// 按照选择的后端创建事件循环，io_uring不可用时（内核版本太低或者被禁用）退回到epoll
+event_loop *create_loop(bool use_uring, http_conn *users, request_pool<http_conn> *pool) {
+    if (use_uring) {
+        try {
+            return new uring_reactor(users, pool);
+        } catch(...) {
+            printf("io_uring不可用，使用epoll\n");
+        }
+    }
+    return new reactor(users, pool);
+}
 
-    while (1) {
-        ret = epoll_wait(epollfd, epevs, MAX_EVENT_NUMBER, -1);
-        if ((ret == -1) && (errno != EINTR)) {
-            perror("epoll_wait");
-            break;
+// 按照选择的请求队列创建线程池，cpus非空时工作线程绑定到这些CPU上
+request_pool<http_conn> *create_pool(const char *queue_type, int thread_number, int max_requests, const std::vector<int> &cpus) {
+    if (strcmp(queue_type, "ring") == 0) {
+        return new threadpool<http_conn, mpmc_queue<http_conn> >(thread_number, max_requests, cpus);
+    }
+    else if (strcmp(queue_type, "steal") == 0) {
+        return new threadpool<http_conn, stealing_queue<http_conn> >(thread_number, max_requests, cpus);
+    }
+    return new threadpool<http_conn>(thread_number, max_requests, cpus);
+}
+
+// 为一组工作线程选择绑定的CPU，node为-1表示不区分节点
+std::vector<int> pick_worker_cpus(const cpu_topology &topo, cpu_topology::PIN_POLICY pin, const std::vector<int> &pin_list, int count, int node) {
+    if (pin == cpu_topology::PIN_LIST) {
+        std::vector<int> cpus;
+        for (size_t i = 0; i < pin_list.size(); ++i) {
+            if (node < 0 || topo.node_of(pin_list[i]) == node) {
+                cpus.push_back(pin_list[i]);
+            }
         }
+        if (!cpus.empty() || node < 0) {
+            return cpus;
+        }
+        // 列表中没有这个节点的CPU，按紧凑策略在节点内选择
+        pin = cpu_topology::PIN_COMPACT;
+    }
+    if (pin == cpu_topology::PIN_NONE) {
+        // NUMA模式下即使没有指定策略，工作线程也要留在自己的节点上
+        if (node < 0) {
+            return std::vector<int>();
+        }
+        pin = cpu_topology::PIN_COMPACT;
+    }
+    return topo.pick(pin, count, node);
+}
+
+// NUMA模式下第i个事件循环绑定的CPU：事件循环轮流分配到各个节点，在节点内依次使用各个CPU
+int numa_loop_cpu(const cpu_topology &topo, int i) {
+    int node = i % topo.node_count();
+    const std::vector<int> &cpus = topo.node_cpus(node);
+    return cpus[(i / topo.node_count()) % cpus.size()];
+}
+
+// 运行在cpu上的事件循环使用的线程池：NUMA模式下每个节点一个线程池，使用同一个节点的那个
+request_pool<http_conn> *pick_pool(const std::vector<request_pool<http_conn> *> &pools, const cpu_topology &topo, int cpu) {
+    if (pools.empty()) {
+        return NULL;
+    }
+    if (pools.size() == 1 || cpu < 0) {
+        return pools[0];
+    }
+    return pools[topo.node_of(cpu) % pools.size()];
+}
+
+void usage(const char *prog) {
+    printf("按照如下格式运行： %s port_number [-r sub_reactors] [-d rr|ll] [-s shards] [-c] [-b epoll|uring] [-t threads|auto] [-q list|ring|steal] [-m max_requests] [-f mmap|sendfile|splice] [-e cache_entries] [-M content_cache_mb] [-B max_request_kb] [-p compact|scatter|cpu_list] [-N] [-l backlog] [-a accept_budget] [-g drain_seconds] [-u control_path] [-T idle,header,write] [-k wheel|heap]\n", prog);
+    printf("  -r  从reactor线程的数量，0表示单reactor模式（默认0）\n");
+    printf("  -d  主reactor分发新连接的策略，rr为轮询，ll为最少连接数（默认rr）\n");
+    printf("  -s  SO_REUSEPORT分片的数量，每个分片线程有自己的监听socket，各自accept并处理连接，设置后忽略-r（默认0）\n");
+    printf("  -b  事件后端，epoll或者uring，uring只支持单线程和分片模式，忽略-r（默认epoll）\n");
+    printf("  -c  分片模式下按收包CPU分发新连接，并把分片线程绑定到对应的CPU上\n");
+    printf("  -t  线程池中线程的数量，0表示不使用线程池，直接在reactor线程中处理请求，auto为可用的CPU数（默认8）\n");
+    printf("  -q  线程池的请求队列，list为互斥锁保护的链表，ring为无锁环形队列，steal为每个线程一个工作窃取队列（默认list）\n");
+    printf("  -m  线程池请求队列的长度（默认10000）\n");
+    printf("  -f  发送文件内容的方式，mmap为映射后和响应头一起writev，sendfile和splice由内核直接从页缓存发送，uring后端总是使用mmap（默认sendfile）\n");
+    printf("  -e  缓存的打开文件数，缓存的文件每秒最多重新stat一次检查是否被修改，0表示不缓存（默认1024）\n");
+    printf("  -M  小文件（不超过%dKB）内容缓存使用的内存，单位MB，命中时直接从内存发送，0表示不使用（默认0）\n", content_cache::MAX_OBJECT / 1024);
+    printf("  -B  读缓冲区的上限，单位KB，向上取整到2的幂，请求行和头部超过这个大小时关闭连接（默认%d）\n", http_conn::m_read_buffer_max / 1024);
+    printf("  -p  工作线程绑定CPU的策略，compact为紧凑（同一个节点、物理核的CPU相邻），scatter为分散（轮流使用各个节点和物理核），\n");
+    printf("      或者给出CPU列表，例如0,2,4-7（默认不绑定）\n");
+    printf("  -N  NUMA模式：每个NUMA节点一个线程池，工作线程和事件循环线程绑定在节点内的CPU上，轮流分配到各个节点，\n");
+    printf("      事件循环只把请求交给自己节点的线程池，-t为所有节点的线程总数，auto时每个节点的线程数等于节点的CPU数\n");
+    printf("  -l  listen的backlog，即监听队列的长度（默认1024，受net.core.somaxconn限制）\n");
+    printf("  -a  每次监听socket就绪时最多accept的连接数（默认%d）\n", DEFAULT_ACCEPT_BUDGET);
+    printf("  -g  收到SIGTERM或SIGINT之后，等待已有连接处理完的最长时间，单位秒（默认30）\n");
+    printf("  -u  不停机升级的控制路径（Unix域socket）：启动时如果有旧进程在这个路径上监听，就接收它的监听socket，\n");
+    printf("      之后自己在这个路径上监听，新进程连接上来时把监听socket交给它，然后平滑退出，新旧进程需要使用相同的-s参数\n");
+    printf("  -T  保持连接空闲、接收请求头、发送响应没有进展的超时时间，单位秒，超时时关闭连接，0表示不限制（默认%d,%d,%d）\n",
+           http_conn::m_timeout_ms[http_conn::TIMEOUT_IDLE] / 1000, http_conn::m_timeout_ms[http_conn::TIMEOUT_HEADER] / 1000,
+           http_conn::m_timeout_ms[http_conn::TIMEOUT_WRITE] / 1000);
+    printf("  -k  管理连接超时的定时器容器，wheel为分层时间轮，heap为4叉最小堆（默认wheel）\n");
+    printf("  发送SIGUSR1打印accept、缓存和超时的统计信息\n");
+}
 
-        for (int i = 0; i < ret; ++i) {
-            int sockfd = epevs[i].data.fd;
-            if (sockfd == lfd) {
-                struct sockaddr_in clientaddr;
-                socklen_t len = sizeof(clientaddr);
-                int connfd = accept(lfd, (struct sockaddr *)&clientaddr, &len);
+int main(int argc, char *argv[]) {
+    if (argc <= 1) {
+        usage(basename(argv[0]));
+        exit(-1);
+    }
 
-                if (http_conn::m_user_count >= MAX_FD) {
-                    // 目前连接数满了
-                    // 给客户端写一个http回复报文信息，服务器正在忙
-                    close(connfd);
-                    continue;
+    // 获取端口号
+    int port = atoi(argv[1]);
+
+    // 解析可选参数
+    int sub_reactor_number = 0;
+    int shard_number = 0;
+    bool cpu_steering = false;
+    bool use_uring = false;
+    int thread_number = 8; // -1表示根据可用的CPU数决定
+    const char *queue_type = "list";
+    int max_requests = 10000;
+    int cache_entries = 1024;
+    int content_cache_mb = 0;
+    int max_request_kb = http_conn::m_read_buffer_max / 1024;
+    cpu_topology::PIN_POLICY pin = cpu_topology::PIN_NONE;
+    std::vector<int> pin_list;
+    bool numa = false;
+    int backlog = 1024;
+    int drain_timeout = 30;
+    const char *handoff_path = NULL;
+    int accept_budget = DEFAULT_ACCEPT_BUDGET;
+    reactor::DISPATCH_POLICY policy = reactor::ROUND_ROBIN;
+    optind = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:s:cb:t:q:m:f:e:M:B:p:Nl:a:g:u:T:k:")) != -1) {
+        switch (opt) {
+            case 'r':
+                sub_reactor_number = atoi(optarg);
+                break;
+            case 'd':
+                policy = (strcmp(optarg, "ll") == 0) ? reactor::LEAST_LOADED : reactor::ROUND_ROBIN;
+                break;
+            case 's':
+                shard_number = atoi(optarg);
+                break;
+            case 'c':
+                cpu_steering = true;
+                break;
+            case 'b':
+                use_uring = (strcmp(optarg, "uring") == 0);
+                break;
+            case 't':
+                thread_number = (strcmp(optarg, "auto") == 0) ? -1 : atoi(optarg);
+                break;
+            case 'q':
+                queue_type = optarg;
+                break;
+            case 'm':
+                max_requests = atoi(optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "mmap") == 0) {
+                    http_conn::m_send_mode = http_conn::SEND_MMAP;
+                }
+                else if (strcmp(optarg, "sendfile") == 0) {
+                    http_conn::m_send_mode = http_conn::SEND_SENDFILE;
+                }
+                else if (strcmp(optarg, "splice") == 0) {
+                    http_conn::m_send_mode = http_conn::SEND_SPLICE;
+                }
+                else {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                break;
+            case 'e':
+                cache_entries = atoi(optarg);
+                break;
+            case 'M':
+                content_cache_mb = atoi(optarg);
+                break;
+            case 'B':
+                max_request_kb = atoi(optarg);
+                break;
+            case 'p':
+                if (strcmp(optarg, "compact") == 0) {
+                    pin = cpu_topology::PIN_COMPACT;
+                }
+                else if (strcmp(optarg, "scatter") == 0) {
+                    pin = cpu_topology::PIN_SCATTER;
+                }
+                else if (cpu_topology::parse_cpu_list(optarg, pin_list)) {
+                    pin = cpu_topology::PIN_LIST;
+                }
+                else {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'l':
+                backlog = atoi(optarg);
+                break;
+            case 'a':
+                accept_budget = atoi(optarg);
+                break;
+            case 'g':
+                drain_timeout = atoi(optarg);
+                break;
+            case 'u':
+                handoff_path = optarg;
+                break;
+            case 'T': {
+                int idle, header, write;
+                if (sscanf(optarg, "%d,%d,%d", &idle, &header, &write) != 3 || idle < 0 || header < 0 || write < 0
+                    || idle > 86400 || header > 86400 || write > 86400) {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                http_conn::m_timeout_ms[http_conn::TIMEOUT_IDLE] = idle * 1000;
+                http_conn::m_timeout_ms[http_conn::TIMEOUT_HEADER] = header * 1000;
+                http_conn::m_timeout_ms[http_conn::TIMEOUT_WRITE] = write * 1000;
+                break;
+            }
+            case 'k':
+                if (strcmp(optarg, "wheel") == 0) {
+                    conn_timers::m_container = conn_timers::WHEEL;
+                }
+                else if (strcmp(optarg, "heap") == 0) {
+                    conn_timers::m_container = conn_timers::HEAP;
                 }
+                else {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                break;
+            default:
+                usage(basename(argv[0]));
+                exit(-1);
+        }
+    }
+
+    if (backlog <= 0 || accept_budget <= 0 || max_requests <= 0 || cache_entries < 0 || content_cache_mb < 0
+        || max_request_kb <= 0 || max_request_kb > 64 * 1024) {
+        usage(basename(argv[0]));
+        exit(-1);
+    }
+
+    http_conn::m_read_buffer_max = buffer_pool::round_up(max_request_kb * 1024);
+    if (http_conn::m_read_buffer_max < http_conn::READ_BUFFER_SIZE) {
+        http_conn::m_read_buffer_max = http_conn::READ_BUFFER_SIZE;
+    }
+
+    // 对 SIGPIPE 信号进行处理
+    addsig(SIGPIPE, SIG_IGN);
+    addsig(SIGUSR1, server_stats::request_dump);
+
+    // SIGTERM和SIGINT在所有线程中屏蔽，只由主线程通过signalfd处理，必须在创建任何线程之前设置
+    sigset_t exit_signals;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGTERM);
+    sigaddset(&exit_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &exit_signals, NULL);
+    int sigfd = signalfd(-1, &exit_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) {
+        perror("signalfd");
+        exit(-1);
+    }
+
+    // 不停机升级：如果有旧进程，从它那里接收监听socket
+    std::vector<int> inherited;
+    if (handoff_path && listener_handoff::receive(handoff_path, inherited)) {
+        printf("从旧进程接收了%d个监听socket\n", (int) inherited.size());
+    }
+
+    cpu_topology topo;
+    printf("可用的CPU数: %d, NUMA节点数: %d\n", topo.cpu_count(), topo.node_count());
 
-                // 将新的客户的数据初始化，放到数组中
-                users[connfd].init(connfd, clientaddr);
+    // 创建线程池，初始化线程池，NUMA模式下每个节点一个
+    std::vector<request_pool<http_conn> *> pools;
+    if (thread_number != 0) {
+        try {
+            int groups = numa ? topo.node_count() : 1;
+            for (int node = 0; node < groups; ++node) {
+                int count = thread_number;
+                if (thread_number < 0) {
+                    count = numa ? (int) topo.node_cpus(node).size() : topo.cpu_count();
+                }
+                else if (numa) {
+                    count = (thread_number + groups - 1 - node) / groups;
+                    if (count <= 0) {
+                        count = 1;
+                    }
+                }
+                std::vector<int> cpus = pick_worker_cpus(topo, pin, pin_list, count, numa ? node : -1);
+                pools.push_back(create_pool(queue_type, count, max_requests, cpus));
             }
-            else if (epevs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // 对方异常断开或者错误等事件
-                users[sockfd].close_conn();
+        } catch(...) {
+            exit(-1);
+        }
+    }
+
+    // 所有连接共享的文件缓存
+    http_conn::m_file_cache = new file_cache(cache_entries);
+    if (content_cache_mb > 0) {
+        try {
+            http_conn::m_content_cache = new content_cache((size_t) content_cache_mb * 1024 * 1024);
+        } catch(...) {
+            printf("创建文件内容缓存失败\n");
+            exit(-1);
+        }
+        printf("文件内容缓存: %zuMB，%s\n", http_conn::m_content_cache->budget() >> 20,
+               http_conn::m_content_cache->huge_pages() ? "使用预留的大页" : "使用透明大页");
+    }
+
+    // 创建一个数组用于保存所有的客户端信息
+    http_conn *users = new http_conn[MAX_FD];
+    if (numa) {
+        // users以fd为下标，任何节点上的线程都可能访问任何一个元素，所以把它交错分布到各个节点上，而不是全部在主线程所在的节点
+        topo.interleave(users, sizeof(http_conn) * MAX_FD);
+    }
+
+    // 所有的事件循环（主reactor在最前面），都在各自的线程中运行，主线程只负责等待退出信号和升级请求
+    std::vector<event_loop *> loops;
+    std::vector<int> lfds;
+    try {
+        if (shard_number > 0) {
+            // SO_REUSEPORT分片模式：每个分片有自己的监听socket和事件循环线程，由内核分发新连接，没有主reactor
+            long cpu_number = sysconf(_SC_NPROCESSORS_ONLN);
+            for (int i = 0; i < shard_number; ++i) {
+                int lfd = take_listener(inherited, port, true, backlog);
+                if (lfd == -1) {
+                    throw std::exception();
+                }
+                lfds.push_back(lfd);
             }
-            else if (epevs[i].events & EPOLLIN) {
-                if (users[sockfd].read()) {
-                    // 一次性把所有数据都读完了
-                    pool->append(users + sockfd);
+            bool steering = cpu_steering && attach_cpu_steering(lfds[0], shard_number);
+
+            for (int i = 0; i < shard_number; ++i) {
+                // 按收包CPU分发时分片i绑定到CPU i上，NUMA模式下分片轮流分配到各个节点，使用节点本地的线程池
+                int cpu = -1;
+                if (steering) {
+                    cpu = i % cpu_number;
                 }
-                else {
-                    users[sockfd].close_conn();
+                else if (numa) {
+                    cpu = numa_loop_cpu(topo, i);
                 }
+
+                event_loop *shard = create_loop(use_uring, users, pick_pool(pools, topo, cpu));
+                loops.push_back(shard);
+                shard->add_listener(lfds[i]);
+                shard->set_accept_budget(accept_budget);
+                shard->set_cpu(cpu);
+            }
+        }
+        else if (use_uring) {
+            int lfd = take_listener(inherited, port, false, backlog);
+            if (lfd == -1) {
+                throw std::exception();
+            }
+            lfds.push_back(lfd);
+
+            // io_uring单线程模式：accept和所有连接的读写都在同一个事件循环中完成
+            event_loop *loop = create_loop(use_uring, users, pick_pool(pools, topo, -1));
+            loops.push_back(loop);
+            loop->add_listener(lfd);
+        }
+        else {
+            int lfd = take_listener(inherited, port, false, backlog);
+            if (lfd == -1) {
+                throw std::exception();
+            }
+            lfds.push_back(lfd);
+
+            // 创建主reactor，并把监听的文件描述符添加到它的epoll对象中
+            reactor *main_reactor = new reactor(users, pick_pool(pools, topo, -1));
+            loops.push_back(main_reactor);
+            main_reactor->add_listener(lfd);
+            main_reactor->set_accept_budget(accept_budget);
+
+            // 主从反应堆模式：主reactor只负责accept，从reactor各自在自己的线程中负责连接的读写
+            for (int i = 0; i < sub_reactor_number; ++i) {
+                // NUMA模式下从reactor轮流分配到各个节点，使用节点本地的线程池
+                int cpu = numa ? numa_loop_cpu(topo, i) : -1;
+                reactor *sub = new reactor(users, pick_pool(pools, topo, cpu));
+                sub->set_cpu(cpu);
+                loops.push_back(sub);
+                main_reactor->add_sub_reactor(sub, policy);
             }
-            else if (epevs[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {
-                    users[sockfd].close_conn();
+        }
+
+        for (size_t i = 0; i < loops.size(); ++i) {
+            if (!loops[i]->start()) {
+                throw std::exception();
+            }
+        }
+    } catch(...) {
+        exit(-1);
+    }
+
+    // 旧进程的监听socket比这里用到的多（例如分片数变少了），多出来的关闭
+    for (size_t i = 0; i < inherited.size(); ++i) {
+        close(inherited[i]);
+    }
+
+    listener_handoff handoff;
+    if (handoff_path && !handoff.listen(handoff_path)) {
+        printf("无法在%s上监听，不支持不停机升级\n", handoff_path);
+    }
+
+    /*
+        等待退出：收到SIGTERM/SIGINT，或者新进程取走了监听socket之后开始平滑退出
+        1. 所有事件循环停止accept，关闭空闲的保持连接，之后的响应都带Connection: close
+        2. 每100毫秒检查一次，所有连接都关闭了或者超过了drain_timeout秒就结束，期间反复关闭新出现的空闲连接
+        平滑退出期间再次收到信号时立即结束
+    */
+    bool draining = false;
+    time_t deadline = 0;
+    while (1) {
+        struct pollfd fds[2];
+        fds[0].fd = sigfd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = handoff.get_fd();
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        int ret = poll(fds, 2, draining ? 100 : -1);
+        if (ret == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        bool start_drain = false;
+        if (ret > 0 && (fds[0].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (draining) {
+                    deadline = 0;
                 }
+                start_drain = true;
+            }
+        }
+        if (ret > 0 && (fds[1].revents & POLLIN) && handoff.send(lfds)) {
+            printf("监听socket已经交给新进程\n");
+            handoff.close();
+            start_drain = true;
+        }
+
+        if (start_drain && !draining) {
+            printf("开始平滑退出，当前连接数: %d\n", (int) http_conn::m_user_count);
+            draining = true;
+            deadline = time(NULL) + drain_timeout;
+            http_conn::m_draining = true;
+        }
+        if (draining) {
+            if (http_conn::m_user_count <= 0 || time(NULL) >= deadline) {
+                break;
+            }
+            for (size_t i = 0; i < loops.size(); ++i) {
+                loops[i]->drain();
             }
         }
     }
+    printf("退出，剩余连接数: %d\n", (int) http_conn::m_user_count);
 
-    close(epollfd);
-    close(lfd);
+    for (size_t i = 0; i < loops.size(); ++i) {
+        loops[i]->stop();
+    }
+    for (size_t i = 0; i < loops.size(); ++i) {
+        loops[i]->join();
+    }
+    // 工作线程可能还在处理请求，会访问事件循环和users，先等它们退出
+    for (size_t i = 0; i < pools.size(); ++i) {
+        delete pools[i];
+    }
+    for (size_t i = 0; i < loops.size(); ++i) {
+        delete loops[i];
+    }
+    for (size_t i = 0; i < lfds.size(); ++i) {
+        close(lfds[i]);
+    }
     delete [] users;
-    delete pool;
+    delete http_conn::m_content_cache;
+    delete http_conn::m_file_cache;
+    close(sigfd);
 
     return 0;
 }
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# 预压缩网站目录中的文本文件，为每个文件生成同目录下的.br、.zst、.gz文件，
+# 服务器根据请求的Accept-Encoding直接发送预压缩文件，请求时不需要压缩
+#
+# 用法： ./precompress.sh [-f] doc_root
+#   -f  重新压缩所有文件（默认只压缩没有预压缩文件或者预压缩文件比原文件旧的）
+#
+# 系统中没有brotli或者zstd命令时跳过对应的编码；压缩之后没有小于原文件的90%时删除，不值得发送
+# 预压缩文件的修改时间设置成和原文件相同，服务器只使用不比原文件旧的预压缩文件
+
+# 值得压缩的文件类型，图片、视频、字体（woff、woff2）本身已经压缩过
+EXTENSIONS="html htm css js json txt xml svg ico md csv wasm"
+MIN_SIZE=256 # 小于这个大小的文件压缩之后省不了几个字节
+
+force=0
+if [ "$1" == "-f" ]; then
+    force=1
+    shift
+fi
+root=$1
+if [ -z "$root" ] || [ ! -d "$root" ]; then
+    echo "按照如下格式运行： $0 [-f] doc_root"
+    exit 1
+fi
+
+# 编码对应的后缀和压缩命令，命令从标准输入读、写到标准输出
+encoders=()
+command -v brotli > /dev/null && encoders+=("br:brotli -c -q 11")
+command -v zstd > /dev/null && encoders+=("zst:zstd -c -q -19")
+command -v gzip > /dev/null && encoders+=("gz:gzip -c -9 -n")
+if [ ${#encoders[@]} -eq 0 ]; then
+    echo "没有找到brotli、zstd、gzip中的任何一个"
+    exit 1
+fi
+
+pattern=()
+for ext in $EXTENSIONS; do
+    [ ${#pattern[@]} -gt 0 ] && pattern+=(-o)
+    pattern+=(-iname "*.$ext")
+done
+
+files=0
+before=0
+after=0
+while IFS= read -r -d '' file; do
+    size=$(stat -c %s "$file")
+    [ "$size" -lt $MIN_SIZE ] && continue
+    files=$((files + 1))
+    before=$((before + size))
+    best=$size
+    for encoder in "${encoders[@]}"; do
+        suffix=${encoder%%:*}
+        cmd=${encoder#*:}
+        out="$file.$suffix"
+        if [ $force -eq 0 ] && [ -f "$out" ] && [ ! "$out" -ot "$file" ]; then
+            packed=$(stat -c %s "$out")
+        else
+            # 先写到临时文件再改名，服务器不会读到写了一半的文件
+            $cmd < "$file" > "$out.tmp" || { rm -f "$out.tmp"; continue; }
+            packed=$(stat -c %s "$out.tmp")
+            if [ $((packed * 10)) -ge $((size * 9)) ]; then
+                rm -f "$out.tmp" "$out"
+                continue
+            fi
+            chmod --reference="$file" "$out.tmp"
+            touch -r "$file" "$out.tmp"
+            mv -f "$out.tmp" "$out"
+        fi
+        [ "$packed" -lt "$best" ] && best=$packed
+    done
+    after=$((after + best))
+done < <(find "$root" -type f \( "${pattern[@]}" \) -print0)
+
+if [ $before -gt 0 ]; then
+    echo "处理了$files个文件，原大小$before字节，按最佳编码发送$after字节（$((after * 100 / before))%）"
+else
+    echo "没有需要压缩的文件"
+fi
@@ -0,0 +1,287 @@
+#include "reactor.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include "stats.h"
+
+// 添加文件描述符到epoll中
+extern void addfd(int epollfd, int fd, bool edge_trigger);
+
+reactor::reactor(http_conn *users, request_pool<http_conn> *pool) : m_epollfd(-1), m_wakeup_fd(-1), m_lfd(-1), m_accept_budget(DEFAULT_ACCEPT_BUDGET), m_events(NULL),
+    m_users(users), m_pool(pool), m_policy(ROUND_ROBIN), m_next_sub(0), m_load(0), m_stop(false), m_drain(false), m_started(false), m_cpu(-1) {
+    m_timers = conn_timers::create();
+    m_epollfd = epoll_create(5);
+    if (m_epollfd == -1) {
+        delete m_timers;
+        throw std::exception();
+    }
+
+    m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup_fd == -1) {
+        close(m_epollfd);
+        delete m_timers;
+        throw std::exception();
+    }
+    addfd(m_epollfd, m_wakeup_fd, false);
+    addfd(m_epollfd, m_timers->get_fd(), false);
+
+    m_events = new struct epoll_event[MAX_EVENT_NUMBER];
+}
+
+reactor::~reactor() {
+    stop();
+    join();
+    close(m_wakeup_fd);
+    close(m_epollfd);
+    delete [] m_events;
+    delete m_timers;
+}
+
+void reactor::add_listener(int lfd) {
+    m_lfd = lfd;
+    addfd(m_epollfd, m_lfd, false);
+}
+
+void reactor::add_sub_reactor(reactor *sub, DISPATCH_POLICY policy) {
+    m_subs.push_back(sub);
+    m_policy = policy;
+}
+
+bool reactor::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void *reactor::worker(void *arg) {
+    reactor *r = (reactor *) arg;
+    if (r->m_cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(r->m_cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+    r->run();
+    return NULL;
+}
+
+void reactor::stop() {
+    m_stop = true;
+    uint64_t one = 1;
+    ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void reactor::drain() {
+    m_drain = true;
+    uint64_t one = 1;
+    ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void reactor::join() {
+    if (m_started) {
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+}
+
+bool reactor::post_conn(int connfd, const struct sockaddr_in &addr) {
+    pending_conn conn;
+    conn.connfd = connfd;
+    conn.addr = addr;
+
+    m_pending_locker.lock();
+    m_pending.push_back(conn);
+    m_pending_locker.unlock();
+
+    // 唤醒本reactor的epoll_wait
+    uint64_t one = 1;
+    return ::write(m_wakeup_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+void reactor::run() {
+    while (!m_stop) {
+        int ret = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+        if ((ret == -1) && (errno != EINTR)) {
+            perror("epoll_wait");
+            break;
+        }
+
+        server_stats::get()->maybe_dump();
+        if (m_drain && m_drain.exchange(false)) {
+            handle_drain();
+        }
+        for (int i = 0; i < ret; ++i) {
+            int sockfd = m_events[i].data.fd;
+            if (sockfd == m_lfd) {
+                handle_accept();
+            }
+            else if (sockfd == m_wakeup_fd) {
+                handle_pending();
+            }
+            else if (sockfd == m_timers->get_fd()) {
+                handle_timeouts();
+            }
+            else {
+                handle_event(m_events[i]);
+            }
+        }
+    }
+}
+
+void reactor::handle_accept() {
+    server_stats *stats = server_stats::get();
+    for (int i = 0; i < m_accept_budget; ++i) {
+        // accept4直接得到非阻塞的socket，不需要再调用fcntl
+        struct sockaddr_in clientaddr;
+        socklen_t len = sizeof(clientaddr);
+        int connfd = accept4(m_lfd, (struct sockaddr *)&clientaddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // fd用完等错误，监听socket是水平触发的，剩下的连接下一轮再处理
+                ++stats->accept_errors;
+            }
+            return;
+        }
+        ++stats->accepted;
+
+        if (connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
+            // 目前连接数满了
+            // 给客户端写一个http回复报文信息，服务器正在忙
+            ++stats->rejected;
+            close(connfd);
+            continue;
+        }
+
+        if (m_subs.empty()) {
+            take_conn(connfd, clientaddr);
+        }
+        else if (!pick_sub()->post_conn(connfd, clientaddr)) {
+            close(connfd);
+        }
+    }
+
+    // 额度用完了，监听队列中可能还有连接，顺便看一下队列是否已经满了
+    check_listen_queue();
+}
+
+// 对监听socket来说，TCP_INFO中的tcpi_unacked是当前的全连接队列长度，tcpi_sacked是listen的backlog
+void reactor::check_listen_queue() {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(m_lfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_sacked > 0 && info.tcpi_unacked >= info.tcpi_sacked) {
+        ++server_stats::get()->queue_full;
+    }
+}
+
+void reactor::handle_pending() {
+    uint64_t cnt;
+    ::read(m_wakeup_fd, &cnt, sizeof(cnt));
+
+    std::vector<pending_conn> conns;
+    m_pending_locker.lock();
+    conns.swap(m_pending);
+    m_pending_locker.unlock();
+
+    for (size_t i = 0; i < conns.size(); ++i) {
+        take_conn(conns[i].connfd, conns[i].addr);
+    }
+}
+
+void reactor::take_conn(int connfd, const struct sockaddr_in &addr) {
+    // 将新的客户的数据初始化，放到数组中
+    m_users[connfd].init(connfd, addr, m_epollfd, &m_load, NULL, m_timers);
+}
+
+reactor *reactor::pick_sub() {
+    if (m_policy == LEAST_LOADED) {
+        reactor *best = m_subs[0];
+        for (size_t i = 1; i < m_subs.size(); ++i) {
+            if (m_subs[i]->load() < best->load()) {
+                best = m_subs[i];
+            }
+        }
+        return best;
+    }
+
+    return m_subs[m_next_sub++ % m_subs.size()];
+}
+
+void reactor::handle_event(struct epoll_event &ev) {
+    int sockfd = ev.data.fd;
+    http_conn *conn = m_users + sockfd;
+
+    // 先记录就绪事件，连接正在被其他线程推进时，由那个线程在交还所有权之前处理
+    conn->add_events(ev.events);
+    if (!conn->try_own()) {
+        return;
+    }
+    dispatch(conn);
+}
+
+void reactor::dispatch(http_conn *conn) {
+    if (conn->drive() != http_conn::IO_PROCESS) {
+        return;
+    }
+
+    if (!m_pool) {
+        // 没有线程池，直接在reactor线程中处理
+        conn->process();
+    }
+    else if (!m_pool->append(conn, sched_getcpu())) {
+        conn->close_conn();
+    }
+}
+
+void reactor::handle_drain() {
+    if (m_lfd != -1) {
+        // 监听socket可能已经交给了新的进程，这里只是不再accept，由main负责关闭
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_lfd, NULL);
+        m_lfd = -1;
+    }
+
+    // 空闲的保持连接不会再有请求被处理完，直接关闭；正在读请求或者发送响应的连接处理完之后自己关闭
+    for (int fd = 0; fd < MAX_FD; ++fd) {
+        http_conn *conn = m_users + fd;
+        if (conn->get_sockfd() != fd || conn->get_epollfd() != m_epollfd || !conn->try_own()) {
+            continue;
+        }
+        if (conn->idle()) {
+            conn->close_conn();
+        }
+        else {
+            dispatch(conn);
+        }
+    }
+}
+
+void reactor::handle_timeouts() {
+    m_timers->collect(m_expired);
+    for (size_t i = 0; i < m_expired.size(); ++i) {
+        http_conn *conn = m_expired[i];
+        if (!conn->try_own()) {
+            // 连接正在被其他线程推进，它交还所有权时如果进入了新的阶段会重新设置定时器，否则下一个tick再检查
+            m_timers->retry(conn);
+            continue;
+        }
+        int kind = m_timers->expired(conn);
+        if (kind >= 0) {
+            conn_timers::count(kind);
+            conn->close_conn();
+        }
+        else {
+            // 交还所有权，期间到达的事件由dispatch处理
+            dispatch(conn);
+        }
+    }
+    m_expired.clear();
+}
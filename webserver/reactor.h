@@ -0,0 +1,91 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+#include "threadpool.h"
+#include "http_conn.h"
+#include "event_loop.h"
+#include "conn_timers.h"
+
+/*
+    反应堆（Reactor）类，每个reactor拥有自己的epoll对象和事件循环
+    单反应堆模式：    只有一个reactor，它同时负责accept和所有连接的读写
+    主从反应堆模式：  主reactor只负责监听socket上的accept，然后把新连接按照轮询或者最少连接数的策略
+                      分发给N个从reactor，每个从reactor在自己的线程中负责这些连接的读写，
+                      每个从reactor只会访问users数组中属于它的那些fd对应的元素
+*/
+class reactor : public event_loop {
+public:
+    // 主reactor分发新连接的策略
+    enum DISPATCH_POLICY {ROUND_ROBIN = 0, LEAST_LOADED};
+
+    // pool为NULL时，请求的解析和响应的生成直接在reactor线程中完成，不再跨线程
+    reactor(http_conn *users, request_pool<http_conn> *pool);
+    ~reactor();
+
+    void add_listener(int lfd) override; // 监听socket，有监听socket的reactor负责accept
+    void add_sub_reactor(reactor *sub, DISPATCH_POLICY policy = ROUND_ROBIN); // 设置从reactor，新连接都交给从reactor处理
+
+    void set_cpu(int cpu) override { m_cpu = cpu; } // 事件循环线程绑定的CPU，-1表示不绑定
+    bool start() override; // 创建线程运行事件循环
+    void run() override; // 在当前线程运行事件循环
+    void stop() override; // 通知事件循环退出
+    void drain() override; // 通知事件循环停止accept并关闭空闲的连接
+    void join() override; // 等待事件循环线程退出
+
+    bool post_conn(int connfd, const struct sockaddr_in &addr); // 把新连接交给本reactor（跨线程调用）
+    int load() const override { return m_load; } // 当前负责的连接数
+    void set_accept_budget(int budget) override { m_accept_budget = budget; }
+
+private:
+    // 等待本reactor接管的新连接
+    struct pending_conn {
+        int connfd;
+        struct sockaddr_in addr;
+    };
+
+    int m_epollfd; // 本reactor的epoll对象
+    int m_wakeup_fd; // eventfd，用于其他线程唤醒本reactor
+    int m_lfd; // 监听的文件描述符，-1表示不负责accept
+    int m_accept_budget; // 每次监听socket就绪时最多accept的连接数
+    struct epoll_event *m_events; // epoll_wait返回的就绪事件
+
+    http_conn *m_users; // 所有的客户端信息
+    request_pool<http_conn> *m_pool; // 线程池
+
+    std::vector<reactor *> m_subs; // 从reactor
+    DISPATCH_POLICY m_policy; // 分发策略
+    unsigned int m_next_sub; // 轮询分发时下一个从reactor的下标
+
+    conn_timers *m_timers; // 本reactor负责的连接的超时
+    std::vector<http_conn *> m_expired; // 一个tick中超时的连接
+
+    std::vector<pending_conn> m_pending; // 其他线程投递过来的新连接
+    locker m_pending_locker; // 保护m_pending的互斥锁
+
+    std::atomic<int> m_load; // 当前负责的连接数
+    std::atomic<bool> m_stop; // 是否结束事件循环
+    std::atomic<bool> m_drain; // 是否有待处理的drain请求
+    pthread_t m_thread; // 事件循环线程
+    bool m_started;
+    int m_cpu; // 绑定的CPU
+
+    static void *worker(void *arg);
+
+    void handle_accept(); // 处理监听socket上的新连接，一次把监听队列取空（最多m_accept_budget个）
+    void check_listen_queue(); // 检查监听队列是否已满
+    void handle_pending(); // 接管其他线程投递过来的新连接
+    void handle_event(struct epoll_event &ev); // 处理客户端socket上的事件
+    void handle_drain(); // 停止accept，关闭本reactor上空闲的连接
+    void handle_timeouts(); // 关闭超时的连接
+    void dispatch(http_conn *conn); // 推进已经拥有的连接，读到数据时交给线程池或者直接处理
+    void take_conn(int connfd, const struct sockaddr_in &addr); // 在本reactor上初始化新连接
+    reactor *pick_sub(); // 根据分发策略选择一个从reactor
+};
+
+#endif
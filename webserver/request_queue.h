@@ -0,0 +1,474 @@
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include <list>
+#include <atomic>
+#include <climits>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "locker.h"
+
+/*
+    线程池的请求队列策略，作为threadpool的模板参数，需要提供下面的接口：
+    Queue(int max_requests, int consumers)  :   最多容纳max_requests个请求，consumers个消费者线程（编号0 ~ consumers-1）
+    bool push(T *request, int hint)         :   非阻塞地放入一个请求，队列满了返回false，hint是希望处理它的消费者，-1表示不指定
+    T *pop(int consumer)                    :   消费者取出一个请求，队列为空时阻塞，stop()之后返回NULL
+    void stop()                             :   唤醒所有阻塞在pop()上的线程
+*/
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// 互斥锁 + 信号量 + std::list 的请求队列，每个请求一次堆内存分配
+template<typename T>
+class locked_queue {
+public:
+    locked_queue(int max_requests, int consumers) : m_max_requests(max_requests), m_consumers(consumers) {}
+
+    bool push(T *request, int hint) {
+        m_queuelocker.lock();
+        if (m_workqueue.size() >= (size_t) m_max_requests) {
+            m_queuelocker.unlock();
+            return false;
+        }
+
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+    T *pop(int consumer) {
+        m_queuestat.wait();
+        m_queuelocker.lock();
+        if (m_workqueue.empty()) {
+            m_queuelocker.unlock();
+            return NULL;
+        }
+
+        T *request = m_workqueue.front();
+        m_workqueue.pop_front();
+        m_queuelocker.unlock();
+        return request;
+    }
+
+    void stop() {
+        // 每个阻塞的线程需要一次post，被唤醒的线程发现队列为空时返回NULL
+        for (int i = 0; i < m_consumers; ++i) {
+            m_queuestat.post();
+        }
+    }
+
+private:
+    // 请求队列最多允许的等待处理的请求数量
+    int m_max_requests;
+    // 消费者线程的数量
+    int m_consumers;
+    // 请求队列
+    std::list<T *> m_workqueue;
+    // 互斥锁
+    locker m_queuelocker;
+    // 信号量
+    sem m_queuestat;
+};
+
+/*
+    空闲消费者的休眠和唤醒，基于futex
+    消费者休眠前先prepare()登记，再检查一次队列，仍然为空才wait()；生产者放入请求之后调用notify_one()
+    两边都有seq_cst的屏障，所以要么消费者的再次检查看到了新请求，要么生产者看到了登记的休眠者
+    没有线程休眠时，notify_one()只有一个屏障和一次读，不进入内核
+*/
+class idle_waiter {
+public:
+    idle_waiter() : m_epoch(0), m_sleepers(0) {}
+
+    int prepare() {
+        int epoch = m_epoch.load(std::memory_order_relaxed);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        return epoch;
+    }
+
+    // prepare()之后发现了请求，不休眠
+    void cancel() {
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // 期间有唤醒的话epoch已经变化，futex_wait立即返回
+    void wait(int epoch) {
+        syscall(SYS_futex, (int *) &m_epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleepers.load(std::memory_order_relaxed) > 0) {
+            m_epoch.fetch_add(1, std::memory_order_relaxed);
+            syscall(SYS_futex, (int *) &m_epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+    }
+
+    void notify_all() {
+        m_epoch.fetch_add(1);
+        syscall(SYS_futex, (int *) &m_epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+private:
+    std::atomic<int> m_epoch; // futex字，每次唤醒时加1
+    std::atomic<int> m_sleepers; // 正在休眠（或准备休眠）的消费者数量
+};
+
+/*
+    有界无锁多生产者多消费者环形队列（Dmitry Vyukov的算法），容量向上取整为2的幂
+    每个槽位有一个序号：序号等于入队位置时槽位空闲，等于入队位置+1时槽位有数据，
+    生产者和消费者各自用CAS抢占位置，不需要锁，也没有每个请求的内存分配
+    只提供非阻塞的接口，阻塞等待由使用者负责
+*/
+template<typename T>
+class mpmc_ring {
+public:
+    mpmc_ring(int capacity) : m_enqueue_pos(0), m_dequeue_pos(0) {
+        size_t size = 1;
+        while (size < (size_t) capacity) {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_cells = new cell[size];
+        for (size_t i = 0; i < size; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~mpmc_ring() {
+        delete [] m_cells;
+    }
+
+    bool try_push(T *request) {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            cell *c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c->data = request;
+                    c->seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                // 槽位还没被消费者取走，队列满了
+                return false;
+            }
+            else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T *&request) {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            cell *c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    request = c->data;
+                    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                // 队列为空
+                return false;
+            }
+            else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    static const int CACHE_LINE = 64;
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T *data;
+    };
+
+    // 入队位置和出队位置之间填充一个缓存行，避免生产者和消费者之间的伪共享
+    // 用填充而不是alignas，是因为C++11的new不保证超过16字节的对齐
+    char m_pad0[CACHE_LINE];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    cell *m_cells;
+    size_t m_mask;
+};
+
+// 无锁环形队列，所有消费者共享一个队列，队列为空时先自旋一小段时间，然后在futex上休眠
+template<typename T>
+class mpmc_queue {
+public:
+    mpmc_queue(int max_requests, int consumers) : m_ring(max_requests), m_stop(false) {}
+
+    bool push(T *request, int hint) {
+        if (!m_ring.try_push(request)) {
+            return false;
+        }
+        m_waiter.notify_one();
+        return true;
+    }
+
+    T *pop(int consumer) {
+        while (!m_stop.load(std::memory_order_relaxed)) {
+            T *request = NULL;
+            for (int i = 0; i < SPIN_COUNT; ++i) {
+                if (m_ring.try_pop(request)) {
+                    return request;
+                }
+                cpu_relax();
+            }
+
+            int epoch = m_waiter.prepare();
+            if (m_ring.try_pop(request)) {
+                m_waiter.cancel();
+                return request;
+            }
+            if (m_stop.load(std::memory_order_relaxed)) {
+                m_waiter.cancel();
+                break;
+            }
+            m_waiter.wait(epoch);
+        }
+        return NULL;
+    }
+
+    void stop() {
+        m_stop = true;
+        m_waiter.notify_all();
+    }
+
+private:
+    static const int SPIN_COUNT = 64; // 休眠之前自旋检查队列的次数
+
+    mpmc_ring<T> m_ring;
+    idle_waiter m_waiter;
+    std::atomic<bool> m_stop;
+};
+
+/*
+    Chase-Lev工作窃取双端队列（固定容量），只有所有者线程可以在底部放入和取出（后进先出），
+    其他线程只能从顶部窃取（先进先出），所有者的操作在没有竞争时不需要CAS
+*/
+template<typename T>
+class ws_deque {
+public:
+    ws_deque(int capacity) : m_top(0), m_bottom(0) {
+        size_t size = 1;
+        while (size < (size_t) capacity) {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_slots = new std::atomic<T *>[size];
+    }
+
+    ~ws_deque() {
+        delete [] m_slots;
+    }
+
+    // 只能由所有者调用；窃取只会让队列变短，返回false之后所有者的push一定成功
+    bool full() const {
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_acquire);
+        return b - t > m_mask;
+    }
+
+    // 只能由所有者调用
+    bool push(T *request) {
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_acquire);
+        if (b - t > m_mask) {
+            return false;
+        }
+        m_slots[b & m_mask].store(request, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 只能由所有者调用
+    T *pop() {
+        long b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // 队列为空
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        T *request = m_slots[b & m_mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // 最后一个元素，和窃取者竞争
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                request = NULL;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return request;
+    }
+
+    // 任何线程都可以调用，竞争失败时返回NULL
+    T *steal() {
+        long t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+
+        T *request = m_slots[t & m_mask].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return NULL;
+        }
+        return request;
+    }
+
+private:
+    std::atomic<long> m_top;
+    std::atomic<long> m_bottom;
+    std::atomic<T *> *m_slots;
+    long m_mask;
+};
+
+/*
+    工作窃取的请求队列，每个消费者（工作线程）有自己的Chase-Lev双端队列
+    Chase-Lev只允许所有者放入，所以生产者（事件循环线程）先放进目标消费者的收件箱（无锁环形队列），
+    消费者取请求的顺序是：自己的双端队列 -> 自己的收件箱（顺便搬一批到双端队列中） -> 窃取其他消费者的双端队列和收件箱
+    同一个CPU上的事件循环的请求总是交给同一个消费者，http_conn的数据留在这个消费者的缓存中，
+    也没有所有线程都去竞争的全局队列，只有空闲的消费者才会去其他消费者那里窃取
+*/
+template<typename T>
+class stealing_queue {
+public:
+    stealing_queue(int max_requests, int consumers) : m_consumers(consumers), m_next(0), m_stop(false) {
+        if (consumers <= 0) {
+            throw std::exception();
+        }
+        int capacity = max_requests / consumers + 1;
+        m_workers = new worker *[consumers];
+        for (int i = 0; i < consumers; ++i) {
+            m_workers[i] = new worker(capacity);
+        }
+    }
+
+    ~stealing_queue() {
+        for (int i = 0; i < m_consumers; ++i) {
+            delete m_workers[i];
+        }
+        delete [] m_workers;
+    }
+
+    bool push(T *request, int hint) {
+        int target = (hint >= 0) ? hint % m_consumers : (m_next++ % m_consumers);
+        // 目标的收件箱满了就依次尝试下一个
+        for (int i = 0; i < m_consumers; ++i) {
+            if (m_workers[(target + i) % m_consumers]->inbox.try_push(request)) {
+                m_waiter.notify_one();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    T *pop(int consumer) {
+        while (!m_stop.load(std::memory_order_relaxed)) {
+            T *request = NULL;
+            for (int i = 0; i < SPIN_COUNT; ++i) {
+                if ((request = try_take(consumer)) != NULL) {
+                    return request;
+                }
+                cpu_relax();
+            }
+
+            int epoch = m_waiter.prepare();
+            if ((request = try_take(consumer)) != NULL) {
+                m_waiter.cancel();
+                return request;
+            }
+            if (m_stop.load(std::memory_order_relaxed)) {
+                m_waiter.cancel();
+                break;
+            }
+            m_waiter.wait(epoch);
+        }
+        return NULL;
+    }
+
+    void stop() {
+        m_stop = true;
+        m_waiter.notify_all();
+    }
+
+private:
+    static const int SPIN_COUNT = 64; // 休眠之前自旋检查队列的次数
+    static const int MOVE_BATCH = 32; // 每次从收件箱搬到双端队列的最大请求数
+
+    struct worker {
+        worker(int capacity) : deque(capacity), inbox(capacity) {}
+
+        ws_deque<T> deque;
+        mpmc_ring<T> inbox;
+    };
+
+    T *try_take(int consumer) {
+        worker *self = m_workers[consumer];
+        T *request = self->deque.pop();
+        if (request) {
+            return request;
+        }
+
+        if (self->inbox.try_pop(request)) {
+            // 双端队列的容量可能小于MOVE_BATCH，搬的过程中生产者也可能继续往收件箱里放，
+            // 所以先确认双端队列还有空位再从收件箱取，取出来的请求一定能放进去
+            // 搬过去的请求可以被空闲的消费者窃取，有线程在休眠的话唤醒一个
+            T *next;
+            int moved = 0;
+            while (moved < MOVE_BATCH && !self->deque.full() && self->inbox.try_pop(next)) {
+                self->deque.push(next);
+                ++moved;
+            }
+            if (moved > 0) {
+                m_waiter.notify_one();
+            }
+            return request;
+        }
+
+        for (int i = 1; i < m_consumers; ++i) {
+            worker *victim = m_workers[(consumer + i) % m_consumers];
+            if ((request = victim->deque.steal()) != NULL) {
+                return request;
+            }
+            if (victim->inbox.try_pop(request)) {
+                return request;
+            }
+        }
+        return NULL;
+    }
+
+    int m_consumers;
+    worker **m_workers;
+    std::atomic<unsigned> m_next; // 没有指定消费者时轮流分配
+    idle_waiter m_waiter;
+    std::atomic<bool> m_stop;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <signal.h>
+#include <atomic>
+
+// 服务器运行时的统计计数，所有线程共享，收到SIGUSR1时由某个事件循环线程打印出来
+class server_stats {
+public:
+    std::atomic<unsigned long> accepted; // 成功accept的连接数
+    std::atomic<unsigned long> rejected; // accept之后因为连接数已满被直接关闭的连接数
+    std::atomic<unsigned long> accept_errors; // accept出错的次数（不包括EAGAIN），例如fd用完
+    std::atomic<unsigned long> queue_full; // 一批accept用完额度时发现监听队列已满的次数
+    std::atomic<unsigned long> content_hits; // 文件内容缓存命中的次数
+    std::atomic<unsigned long> content_misses; // 文件内容缓存未命中、需要从文件读入的次数
+    std::atomic<unsigned long> content_evictions; // 文件内容缓存淘汰的对象数
+    std::atomic<long> content_bytes; // 文件内容缓存已经分配出去的内存字节数
+    std::atomic<unsigned long> idle_timeouts; // 保持连接空闲超时被关闭的连接数
+    std::atomic<unsigned long> header_timeouts; // 没有在期限内发完请求头被关闭的连接数
+    std::atomic<unsigned long> write_timeouts; // 发送响应长时间没有进展被关闭的连接数
+
+    static server_stats *get() {
+        static server_stats s;
+        return &s;
+    }
+
+    // SIGUSR1的信号处理函数只设置标记，由事件循环在下一轮检查
+    static void request_dump(int sig) {
+        get()->m_dump_requested = true;
+    }
+
+    // 事件循环每一轮调用一次，有打印请求时只有一个线程会真正打印
+    void maybe_dump() {
+        if (m_dump_requested && m_dump_requested.exchange(false)) {
+            print(stdout);
+        }
+    }
+
+    void print(FILE *fp) {
+        fprintf(fp, "accepted: %lu, rejected: %lu, accept_errors: %lu, queue_full: %lu\n",
+                accepted.load(), rejected.load(), accept_errors.load(), queue_full.load());
+        fprintf(fp, "content cache hits: %lu, misses: %lu, evictions: %lu, bytes: %ld\n",
+                content_hits.load(), content_misses.load(), content_evictions.load(), content_bytes.load());
+        fprintf(fp, "timeouts idle: %lu, header: %lu, write: %lu\n",
+                idle_timeouts.load(), header_timeouts.load(), write_timeouts.load());
+        fflush(fp);
+    }
+
+private:
+    server_stats() : accepted(0), rejected(0), accept_errors(0), queue_full(0),
+        content_hits(0), content_misses(0), content_evictions(0), content_bytes(0),
+        idle_timeouts(0), header_timeouts(0), write_timeouts(0), m_dump_requested(false) {}
+
+    std::atomic<bool> m_dump_requested;
+};
+
+#endif
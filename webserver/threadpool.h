@@ -2,110 +2,134 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
+#include <sched.h>
 #include <exception>
 #include <cstdio>
-#include "locker.h"
+#include <atomic>
+#include <vector>
+#include "request_queue.h"
 
-// 线程池类，定义成模板类是为了代码的复用，模板参数T是任务类
+// 线程池对外的接口，和请求队列的实现无关，事件循环只依赖这个接口
 template<typename T>
-class threadpool {
+class request_pool {
 public:
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    virtual ~request_pool() {}
+
+    // hint是希望处理这个请求的工作线程，通常是调用者所在的CPU，-1表示不指定
+    virtual bool append(T *request, int hint = -1) = 0;
+};
+
+// 线程池类，定义成模板类是为了代码的复用，模板参数T是任务类，Queue是请求队列的实现（见request_queue.h）
+template<typename T, typename Queue = locked_queue<T> >
+class threadpool : public request_pool<T> {
+public:
+    // cpus非空时，第i个工作线程绑定到cpus[i % cpus.size()]上
+    threadpool(int thread_number = 8, int max_requests = 10000, const std::vector<int> &cpus = std::vector<int>());
     
     ~threadpool();
 
-    bool append(T *request);
+    bool append(T *request, int hint = -1) override;
 
 private:
     // 线程的数量
     int m_thread_number;
     // 线程池数组
     pthread_t *m_threads;
-    // 请求队列最多允许的等待处理的请求数量
-    int m_max_requests;
     // 请求队列
-    std::list<T *> m_workqueue;
-    // 互斥锁
-    locker m_queuelocker;
-    // 信号量
-    sem m_queuestat;
+    Queue m_workqueue;
     // 是否结束线程
-    bool m_stop;
+    std::atomic<bool> m_stop;
+    // 下一个启动的工作线程的编号
+    std::atomic<int> m_next_worker;
+    // 工作线程绑定的CPU
+    std::vector<int> m_cpus;
+    // CPU号 -> 绑定在这个CPU上的工作线程编号，-1表示没有，用来把append的hint（调用者所在的CPU）换成工作线程
+    std::vector<int> m_cpu_worker;
 
     static void *worker(void *arg);
 
     void run();
+    void shutdown();
 };
 
-template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL) {
+template<typename T, typename Queue>
+threadpool<T, Queue>::threadpool(int thread_number, int max_requests, const std::vector<int> &cpus) : m_thread_number(thread_number), m_threads(NULL),
+    m_workqueue(max_requests, thread_number), m_stop(false), m_next_worker(0), m_cpus(cpus) {
     if ((thread_number <= 0) || (max_requests <= 0)) {
         throw std::exception();
     }
 
+    for (int i = 0; i < m_thread_number && !m_cpus.empty(); ++i) {
+        int cpu = m_cpus[i % m_cpus.size()];
+        if (cpu >= (int) m_cpu_worker.size()) {
+            m_cpu_worker.resize(cpu + 1, -1);
+        }
+        if (m_cpu_worker[cpu] == -1) {
+            m_cpu_worker[cpu] = i;
+        }
+    }
+
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads) {
         throw std::exception();
     }
 
-    // 创建 m_thread_number 个线程， 并设置成线程脱离
+    // 创建 m_thread_number 个线程，析构时唤醒并等待它们退出
     for (int i = 0; i < m_thread_number; ++i) {
         printf("create the %dth thread\n", i);
         if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-            delete [] m_threads;
-            throw std::exception();
-        }
-
-        if (pthread_detach(m_threads[i]) != 0) {
-            delete [] m_threads;
+            m_thread_number = i;
+            shutdown();
             throw std::exception();
         }
     }
 
 }
 
-template<typename T>
-threadpool<T>::~threadpool() {
-    delete [] m_threads;
-    m_stop = true;
+template<typename T, typename Queue>
+threadpool<T, Queue>::~threadpool() {
+    shutdown();
 }
 
-template<typename T>
-bool threadpool<T>::append(T *request) {
-    m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {
-        m_queuelocker.unlock();
-        return false;
+// 通知所有工作线程退出并等待它们结束，正在处理的请求会处理完，队列中剩下的请求被丢弃
+template<typename T, typename Queue>
+void threadpool<T, Queue>::shutdown() {
+    m_stop = true;
+    m_workqueue.stop();
+    for (int i = 0; i < m_thread_number; ++i) {
+        pthread_join(m_threads[i], NULL);
     }
+    delete [] m_threads;
+    m_threads = NULL;
+}
 
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
-    return true;
+template<typename T, typename Queue>
+bool threadpool<T, Queue>::append(T *request, int hint) {
+    if (hint >= 0 && hint < (int) m_cpu_worker.size() && m_cpu_worker[hint] != -1) {
+        hint = m_cpu_worker[hint];
+    }
+    return m_workqueue.push(request, hint);
 }
 
-template<typename T>
-void *threadpool<T>::worker(void *arg) {
+template<typename T, typename Queue>
+void *threadpool<T, Queue>::worker(void *arg) {
     threadpool *pool = (threadpool *) arg;
     pool->run();
     return NULL;
 }
 
-template<typename T>
-void threadpool<T>::run() {
+template<typename T, typename Queue>
+void threadpool<T, Queue>::run() {
+    // 工作线程的编号，工作窃取的队列用它找到自己的双端队列
+    int id = m_next_worker++;
+    if (!m_cpus.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(m_cpus[id % m_cpus.size()], &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
     while (!m_stop) {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
-        }
-
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-
+        T *request = m_workqueue.pop(id);
         if (!request) {
             continue;
         }
@@ -0,0 +1,182 @@
+#ifndef TIMER_HEAP
+#define TIMER_HEAP
+
+#include <exception>
+#include <vector>
+#include "timer_node.h"
+
+/*
+    ARITY叉最小堆，和timer_wheel接口相同，可以互相替换
+    - 堆数组中存放到期时间和节点指针，节点的index记录自己在数组中的下标，删除和调整不需要查找，O(log n)
+    - 4叉堆比二叉堆矮一半，每项16字节，下沉时比较的4个孩子连续存放（共64字节），比较时不需要访问节点本身
+    - 时间同样以tick为单位，tick()取出所有到期的定时器；和时间轮不同，定时的长度没有上限，
+      堆中定时器的个数也不影响tick的开销
+    - 数组只在定时器的个数超过历史最大值时增长，之后添加、调整、到期都不分配内存
+*/
+template< int ARITY = 4 >
+class timer_heap {
+public:
+    explicit timer_heap( int tick_ms = 100 ) : m_tick_ms( tick_ms ), m_current( 0 ), m_timerfd( -1 ) {
+        static_assert( ARITY >= 2, "ARITY must be at least 2" );
+        if( tick_ms <= 0 ) {
+            throw std::exception();
+        }
+    }
+
+    // 堆不拥有定时器，销毁时只把还在堆中的定时器标记为不在堆中
+    ~timer_heap() {
+        for( size_t i = 0; i < m_heap.size(); ++i ) {
+            m_heap[i].timer->index = -1;
+        }
+        if( m_timerfd != -1 ) {
+            close( m_timerfd );
+        }
+    }
+
+    // 添加定时器，timeout_ms毫秒之后到期（向上取整到tick，至少1个tick）；已经在堆中时相当于adjust_timer
+    void add_timer( timer_node* timer, int timeout_ms ) {
+        uint64_t ticks = ( timeout_ms + m_tick_ms - 1 ) / m_tick_ms;
+        if( ticks == 0 ) {
+            ticks = 1;
+        }
+        uint64_t expire = m_current + ticks;
+        if( pending( timer ) ) {
+            uint64_t old = timer->expire;
+            timer->expire = expire;
+            m_heap[timer->index].expire = expire;
+            if( expire < old ) {
+                sift_up( timer->index );
+            }
+            else {
+                sift_down( timer->index );
+            }
+            return;
+        }
+        timer->expire = expire;
+        timer->index = m_heap.size();
+        m_heap.push_back( entry( expire, timer ) );
+        sift_up( timer->index );
+    }
+
+    // 调整定时器的到期时间，O(log n)
+    void adjust_timer( timer_node* timer, int timeout_ms ) {
+        add_timer( timer, timeout_ms );
+    }
+
+    // 删除定时器，不在堆中时什么也不做
+    void del_timer( timer_node* timer ) {
+        if( pending( timer ) ) {
+            remove_at( timer->index );
+        }
+    }
+
+    // 是否在堆中
+    bool pending( const timer_node* timer ) const { return timer->index >= 0; }
+
+    // 前进一个tick，调用所有到期定时器的回调函数，回调中可以添加、删除任何定时器
+    void tick() {
+        ++m_current;
+        while( !m_heap.empty() && m_heap[0].expire <= m_current ) {
+            timer_node* timer = m_heap[0].timer;
+            remove_at( 0 );
+            timer->cb_func( timer->user_data );
+        }
+    }
+
+    // 创建周期为一个tick的timerfd，返回的fd可读时调用handle_timerfd
+    int timerfd() {
+        if( m_timerfd == -1 ) {
+            m_timerfd = create_tick_timerfd( m_tick_ms );
+        }
+        return m_timerfd;
+    }
+
+    // 读出timerfd到期的次数，事件循环处理得慢、错过了几个tick时一次补上
+    void handle_timerfd() {
+        uint64_t expirations = read_tick_timerfd( m_timerfd );
+        while( expirations-- > 0 ) {
+            tick();
+        }
+    }
+
+    size_t size() const { return m_heap.size(); }  // 堆中的定时器数
+    uint64_t now() const { return m_current; }  // 当前的tick
+    int tick_ms() const { return m_tick_ms; }
+
+private:
+    // 堆数组中的一项，到期时间和节点中的相同，放在数组中是为了比较时不访问节点
+    struct entry {
+        uint64_t expire;
+        timer_node* timer;
+
+        entry( uint64_t expire, timer_node* timer ) : expire( expire ), timer( timer ) {}
+    };
+
+    // 删除下标为i的定时器，用最后一项填补空位，再根据它和周围的大小关系上浮或者下沉
+    void remove_at( int i ) {
+        m_heap[i].timer->index = -1;
+        entry last = m_heap.back();
+        m_heap.pop_back();
+        if( i == (int) m_heap.size() ) {
+            return;
+        }
+        m_heap[i] = last;
+        last.timer->index = i;
+        if( i > 0 && last.expire < m_heap[( i - 1 ) / ARITY].expire ) {
+            sift_up( i );
+        }
+        else {
+            sift_down( i );
+        }
+    }
+
+    void sift_up( int i ) {
+        entry item = m_heap[i];
+        while( i > 0 ) {
+            int parent = ( i - 1 ) / ARITY;
+            if( m_heap[parent].expire <= item.expire ) {
+                break;
+            }
+            m_heap[i] = m_heap[parent];
+            m_heap[i].timer->index = i;
+            i = parent;
+        }
+        m_heap[i] = item;
+        item.timer->index = i;
+    }
+
+    void sift_down( int i ) {
+        entry item = m_heap[i];
+        int n = m_heap.size();
+        while( 1 ) {
+            int first = i * ARITY + 1;
+            if( first >= n ) {
+                break;
+            }
+            // 找出最早到期的孩子
+            int last = first + ARITY < n ? first + ARITY : n;
+            int child = first;
+            for( int j = first + 1; j < last; ++j ) {
+                if( m_heap[j].expire < m_heap[child].expire ) {
+                    child = j;
+                }
+            }
+            if( item.expire <= m_heap[child].expire ) {
+                break;
+            }
+            m_heap[i] = m_heap[child];
+            m_heap[i].timer->index = i;
+            i = child;
+        }
+        m_heap[i] = item;
+        item.timer->index = i;
+    }
+
+private:
+    int m_tick_ms;
+    uint64_t m_current; // 当前的tick
+    int m_timerfd;
+    std::vector< entry > m_heap;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef TIMER_NODE_H
+#define TIMER_NODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+/*
+    定时器容器（timer_wheel、timer_heap）共用的定时器节点
+    节点由使用者分配，通常是连接对象的成员，容器只负责把它串起来，添加、调整、到期都不分配和释放内存；
+    到期时容器先把节点摘下来再调用回调函数，回调函数中可以重新添加节点，或者让节点所在的对象失效
+*/
+class timer_node {
+public:
+    timer_node() : expire( 0 ), cb_func( NULL ), user_data( NULL ), prev( NULL ), next( NULL ), index( -1 ) {}
+
+public:
+    uint64_t expire;    // 到期的tick，绝对值
+    void (*cb_func)( void* );   // 到期时的回调函数，参数为user_data
+    void* user_data;
+    timer_node* prev;   // timer_wheel：所在槽的双向链表
+    timer_node* next;
+    int index;          // timer_heap：在堆数组中的下标，不在堆中时为-1
+};
+
+// 创建周期为tick_ms毫秒的timerfd，可以和socket一起放进epoll，失败时返回-1
+inline int create_tick_timerfd( int tick_ms ) {
+    int fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if( fd == -1 ) {
+        return -1;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = tick_ms / 1000;
+    its.it_interval.tv_nsec = ( tick_ms % 1000 ) * 1000000L;
+    its.it_value = its.it_interval;
+    if( timerfd_settime( fd, 0, &its, NULL ) == -1 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+// 读出timerfd到期的次数，事件循环处理得慢时可能大于1，没有到期时返回0
+inline uint64_t read_tick_timerfd( int fd ) {
+    uint64_t expirations = 0;
+    if( read( fd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) ) {
+        return 0;
+    }
+    return expirations;
+}
+
+#endif
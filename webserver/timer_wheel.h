@@ -0,0 +1,161 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include <exception>
+#include "timer_node.h"
+
+/*
+    分层时间轮，替代sort_timer_lst
+    - 时间以tick为单位（tick的长度由使用者决定，比如100毫秒），共4层，每层64个槽，
+      第0层的每个槽对应1个tick，第1层的每个槽对应64个tick，以此类推，最长可以表示2^24个tick
+    - 每个槽是一个带哨兵的双向循环链表，添加、删除、调整定时器都是O(1)，不需要遍历
+    - 每个tick处理第0层的一个槽，槽中的定时器全部到期；第0层转完一圈时把第1层的下一个槽
+      重新分配到第0层（高层依次类推），每个定时器最多被搬动3次
+    - tick由timerfd驱动，timerfd可以和socket一起放进epoll，不需要SIGALRM和信号处理函数
+*/
+class timer_wheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MAX_TICKS = ( 1ULL << ( SLOT_BITS * LEVELS ) ) - 1; // 最长的定时，更长的按这个值处理
+
+    explicit timer_wheel( int tick_ms = 100 ) : m_tick_ms( tick_ms ), m_current( 0 ), m_count( 0 ), m_timerfd( -1 ) {
+        if( tick_ms <= 0 ) {
+            throw std::exception();
+        }
+        for( int i = 0; i < LEVELS; ++i ) {
+            for( int j = 0; j < SLOTS; ++j ) {
+                m_slots[i][j].prev = m_slots[i][j].next = &m_slots[i][j];
+            }
+        }
+    }
+
+    // 时间轮不拥有定时器，销毁时只把还在轮中的定时器摘下来
+    ~timer_wheel() {
+        for( int i = 0; i < LEVELS; ++i ) {
+            for( int j = 0; j < SLOTS; ++j ) {
+                timer_node* head = &m_slots[i][j];
+                while( head->next != head ) {
+                    unlink( head->next );
+                }
+            }
+        }
+        if( m_timerfd != -1 ) {
+            close( m_timerfd );
+        }
+    }
+
+    // 添加定时器，timeout_ms毫秒之后到期（向上取整到tick，至少1个tick）；已经在轮中时相当于adjust_timer
+    void add_timer( timer_node* timer, int timeout_ms ) {
+        if( pending( timer ) ) {
+            unlink( timer );
+        }
+        uint64_t ticks = ( timeout_ms + m_tick_ms - 1 ) / m_tick_ms;
+        if( ticks == 0 ) {
+            ticks = 1;
+        }
+        if( ticks > MAX_TICKS ) {
+            ticks = MAX_TICKS;
+        }
+        timer->expire = m_current + ticks;
+        place( timer );
+        ++m_count;
+    }
+
+    // 调整定时器的到期时间，活跃的连接每次有读写都推迟一次，O(1)
+    void adjust_timer( timer_node* timer, int timeout_ms ) {
+        add_timer( timer, timeout_ms );
+    }
+
+    // 删除定时器，不在轮中时什么也不做
+    void del_timer( timer_node* timer ) {
+        if( pending( timer ) ) {
+            unlink( timer );
+        }
+    }
+
+    // 是否在时间轮中
+    bool pending( const timer_node* timer ) const { return timer->next != NULL; }
+
+    // 前进一个tick，调用所有到期定时器的回调函数，回调中可以添加、删除任何定时器
+    void tick() {
+        ++m_current;
+        // 低层转完一圈时，把高一层的下一个槽重新分配到低层
+        for( int level = 1; level < LEVELS; ++level ) {
+            if( ( m_current & ( ( 1ULL << ( SLOT_BITS * level ) ) - 1 ) ) != 0 ) {
+                break;
+            }
+            cascade( level, ( m_current >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 ) );
+        }
+
+        timer_node* head = &m_slots[0][m_current & ( SLOTS - 1 )];
+        while( head->next != head ) {
+            timer_node* timer = head->next;
+            unlink( timer );
+            timer->cb_func( timer->user_data );
+        }
+    }
+
+    // 创建周期为一个tick的timerfd，返回的fd可读时调用handle_timerfd
+    int timerfd() {
+        if( m_timerfd == -1 ) {
+            m_timerfd = create_tick_timerfd( m_tick_ms );
+        }
+        return m_timerfd;
+    }
+
+    // 读出timerfd到期的次数，事件循环处理得慢、错过了几个tick时一次补上
+    void handle_timerfd() {
+        uint64_t expirations = read_tick_timerfd( m_timerfd );
+        while( expirations-- > 0 ) {
+            tick();
+        }
+    }
+
+    size_t size() const { return m_count; }  // 轮中的定时器数
+    uint64_t now() const { return m_current; }  // 当前的tick
+    int tick_ms() const { return m_tick_ms; }
+
+private:
+    // 按照离到期还有多少个tick放进对应层的槽
+    void place( timer_node* timer ) {
+        uint64_t delta = timer->expire - m_current;
+        int level = 0;
+        while( level < LEVELS - 1 && delta >= ( 1ULL << ( SLOT_BITS * ( level + 1 ) ) ) ) {
+            ++level;
+        }
+        timer_node* head = &m_slots[level][( timer->expire >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 )];
+        timer->next = head;
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    void unlink( timer_node* timer ) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+        --m_count;
+    }
+
+    // 把高层一个槽中的定时器按剩余时间重新放到低层
+    void cascade( int level, int slot ) {
+        timer_node* head = &m_slots[level][slot];
+        while( head->next != head ) {
+            timer_node* timer = head->next;
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            place( timer );
+        }
+    }
+
+private:
+    int m_tick_ms;
+    uint64_t m_current; // 当前的tick
+    size_t m_count;
+    int m_timerfd;
+    timer_node m_slots[LEVELS][SLOTS]; // 每个槽的哨兵
+};
+
+#endif
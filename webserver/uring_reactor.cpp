@@ -0,0 +1,613 @@
+#include "uring_reactor.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "stats.h"
+
+// user_data的低8位是操作类型，高位是fd
+#define URING_DATA(fd, op) (((uint64_t)(fd) << 8) | (op))
+#define URING_FD(data) ((int)((data) >> 8))
+#define URING_OP(data) ((int)((data) & 0xff))
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_reactor::uring_reactor(http_conn *users, request_pool<http_conn> *pool) : m_ring_fd(-1), m_sq_ptr(MAP_FAILED), m_sq_size(0),
+    m_cq_ptr(MAP_FAILED), m_cq_size(0), m_sqes((struct io_uring_sqe *) MAP_FAILED), m_sqes_size(0), m_to_submit(0),
+    m_buf_ring((struct io_uring_buf_ring *) MAP_FAILED), m_buf_ring_size(0), m_bufs(NULL), m_lfd(-1), m_wakeup_fd(-1),
+    m_wakeup_val(0), m_states(NULL), m_users(users), m_pool(pool), m_timers(NULL), m_load(0), m_stop(false), m_drain(false), m_started(false), m_cpu(-1) {
+    m_timers = conn_timers::create();
+    m_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    m_states = new conn_state[MAX_FD];
+    memset(m_states, 0, sizeof(conn_state) * MAX_FD);
+    m_bufs = new char[BUF_COUNT * BUF_SIZE];
+
+    if (m_wakeup_fd == -1 || !setup_ring() || !setup_buffers()) {
+        cleanup();
+        throw std::exception();
+    }
+}
+
+uring_reactor::~uring_reactor() {
+    stop();
+    join();
+    cleanup();
+}
+
+// 释放io_uring实例、共享内存和读缓冲区
+void uring_reactor::cleanup() {
+    if (m_buf_ring != MAP_FAILED) {
+        munmap(m_buf_ring, m_buf_ring_size);
+    }
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) {
+        munmap(m_cq_ptr, m_cq_size);
+    }
+    if (m_sq_ptr != MAP_FAILED) {
+        munmap(m_sq_ptr, m_sq_size);
+    }
+    if (m_ring_fd != -1) {
+        close(m_ring_fd);
+    }
+    if (m_wakeup_fd != -1) {
+        close(m_wakeup_fd);
+    }
+    delete [] m_bufs;
+    delete [] m_states;
+    delete m_timers;
+}
+
+// 创建io_uring实例，并把提交队列、完成队列和sqe数组映射到用户空间
+bool uring_reactor::setup_ring() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // 完成事件只在我们调用io_uring_enter时处理，不需要内核打断事件循环线程
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    m_ring_fd = io_uring_setup(RING_ENTRIES, &p);
+    if (m_ring_fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        m_ring_fd = io_uring_setup(RING_ENTRIES, &p);
+    }
+    if (m_ring_fd == -1) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_size > m_sq_size) {
+            m_sq_size = m_cq_size;
+        }
+        m_cq_size = m_sq_size;
+    }
+
+    m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+        perror("mmap sq ring");
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ptr = m_sq_ptr;
+    }
+    else {
+        m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED) {
+            perror("mmap cq ring");
+            return false;
+        }
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *) mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        perror("mmap sqes");
+        return false;
+    }
+
+    char *sq = (char *) m_sq_ptr;
+    m_sq_head = (unsigned *)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    m_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = (char *) m_cq_ptr;
+    m_cq_head = (unsigned *)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    m_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+// 注册提供给内核的读缓冲区环，recv时由内核从中挑选一块空闲的缓冲区
+bool uring_reactor::setup_buffers() {
+    m_buf_ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+    m_buf_ring = (struct io_uring_buf_ring *) mmap(0, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_buf_ring == MAP_FAILED) {
+        perror("mmap buf ring");
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(unsigned long) m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register pbuf ring");
+        return false;
+    }
+
+    for (unsigned i = 0; i < BUF_COUNT; ++i) {
+        struct io_uring_buf *buf = buf_entry(i);
+        buf->addr = (uint64_t)(unsigned long)(m_bufs + i * BUF_SIZE);
+        buf->len = BUF_SIZE;
+        buf->bid = i;
+    }
+    __atomic_store_n(&m_buf_ring->tail, (unsigned short) BUF_COUNT, __ATOMIC_RELEASE);
+    return true;
+}
+
+// 缓冲区环的第i项。环的第0项和tail字段重叠，内核头文件中的柔性数组bufs在C++下偏移不为0，不能直接使用
+struct io_uring_buf *uring_reactor::buf_entry(unsigned i) {
+    return (struct io_uring_buf *) m_buf_ring + i;
+}
+
+// 把用完的缓冲区还给内核
+void uring_reactor::recycle_buffer(unsigned bid) {
+    unsigned short tail = m_buf_ring->tail;
+    struct io_uring_buf *buf = buf_entry(tail & (BUF_COUNT - 1));
+    buf->addr = (uint64_t)(unsigned long)(m_bufs + bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&m_buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// 取一个空闲的sqe，提交队列满了就先提交一次
+struct io_uring_sqe *uring_reactor::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *m_sq_tail;
+    if (tail - head >= RING_ENTRIES) {
+        submit_and_wait(0);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= RING_ENTRIES) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = tail & *m_sq_mask;
+    struct io_uring_sqe *sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[idx] = idx;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++m_to_submit;
+    return sqe;
+}
+
+// 批量提交填好的sqe，并至少等待wait_nr个完成事件
+int uring_reactor::submit_and_wait(unsigned wait_nr) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret = io_uring_enter(m_ring_fd, m_to_submit, wait_nr, flags);
+    if (ret >= 0) {
+        m_to_submit -= (unsigned) ret < m_to_submit ? ret : m_to_submit;
+    }
+    return ret;
+}
+
+void uring_reactor::add_listener(int lfd) {
+    m_lfd = lfd;
+}
+
+bool uring_reactor::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void *uring_reactor::worker(void *arg) {
+    uring_reactor *r = (uring_reactor *) arg;
+    if (r->m_cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(r->m_cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+    r->run();
+    return NULL;
+}
+
+void uring_reactor::stop() {
+    m_stop = true;
+    uint64_t one = 1;
+    ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void uring_reactor::drain() {
+    m_drain = true;
+    uint64_t one = 1;
+    ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void uring_reactor::join() {
+    if (m_started) {
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+}
+
+void uring_reactor::prep_accept() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        return;
+    }
+    // 多次触发的accept拿不到每个连接的对端地址，连接的地址留空
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_lfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(m_lfd, OP_ACCEPT);
+}
+
+void uring_reactor::prep_wakeup() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakeup_fd;
+    sqe->addr = (uint64_t)(unsigned long) &m_wakeup_val;
+    sqe->len = sizeof(m_wakeup_val);
+    sqe->user_data = URING_DATA(m_wakeup_fd, OP_WAKEUP);
+}
+
+void uring_reactor::prep_recv(int fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_states[fd].closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = URING_DATA(fd, OP_RECV);
+    ++m_states[fd].inflight;
+}
+
+void uring_reactor::prep_write(http_conn *conn) {
+    int fd = conn->get_sockfd();
+    int iov_count = 0;
+    struct iovec *iov = conn->get_iov(iov_count);
+
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_states[fd].closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(unsigned long) iov;
+    sqe->len = iov_count;
+    sqe->user_data = URING_DATA(fd, OP_WRITEV);
+    ++m_states[fd].inflight;
+
+    // 保持连接时把下一次recv链接在writev后面，writev没写完时内核会取消这个recv，重新提交即可；
+    // 读缓冲区中还有流水线发来的请求时不需要recv，writev完成之后直接处理
+    if (conn->get_linger() && !conn->has_pending_input()) {
+        sqe->flags |= IOSQE_IO_LINK;
+        prep_recv(fd);
+    }
+}
+
+// 取消user_data对应的操作，被取消的操作以-ECANCELED完成，取消操作自己的完成事件直接忽略
+void uring_reactor::prep_cancel(uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_DATA(0, OP_CANCEL);
+}
+
+// timerfd可读时完成，一次只等待一次
+void uring_reactor::prep_timer() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_timers->get_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATA(m_timers->get_fd(), OP_TIMER);
+}
+
+void uring_reactor::run() {
+    if (m_lfd != -1) {
+        prep_accept();
+    }
+    prep_wakeup();
+    prep_timer();
+
+    while (!m_stop) {
+        int ret = submit_and_wait(1);
+        if (ret == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        server_stats::get()->maybe_dump();
+
+        // 收割所有的完成事件
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+            handle_cqe(cqe);
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        if (m_drain && m_drain.exchange(false)) {
+            handle_drain();
+        }
+    }
+}
+
+void uring_reactor::handle_cqe(struct io_uring_cqe *cqe) {
+    int fd = URING_FD(cqe->user_data);
+    switch (URING_OP(cqe->user_data)) {
+        case OP_ACCEPT :
+            handle_accept(cqe->res, cqe->flags);
+            break;
+        case OP_RECV :
+            handle_recv(fd, cqe->res, cqe->flags);
+            break;
+        case OP_WRITEV :
+            handle_write(fd, cqe->res);
+            break;
+        case OP_WAKEUP :
+            handle_pending();
+            if (!m_stop) {
+                prep_wakeup();
+            }
+            break;
+        case OP_TIMER :
+            handle_timeouts();
+            if (!m_stop) {
+                prep_timer();
+            }
+            break;
+        default :
+            break;
+    }
+}
+
+void uring_reactor::handle_accept(int res, unsigned flags) {
+    // 多次触发的accept出错或者被内核终止时，重新提交（drain之后不再提交）
+    if (!(flags & IORING_CQE_F_MORE) && m_lfd != -1) {
+        prep_accept();
+    }
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+            ++server_stats::get()->accept_errors;
+        }
+        return;
+    }
+
+    int connfd = res;
+    ++server_stats::get()->accepted;
+    if (connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
+        // 目前连接数满了
+        ++server_stats::get()->rejected;
+        close(connfd);
+        return;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    m_states[connfd].inflight = 0;
+    m_states[connfd].closing = false;
+    m_users[connfd].init(connfd, addr, -1, &m_load, this, m_timers);
+    prep_recv(connfd);
+}
+
+void uring_reactor::handle_recv(int fd, int res, unsigned flags) {
+    http_conn *conn = m_users + fd;
+    if (res > 0) {
+        // 内核选中的缓冲区编号在flags的高16位，拷贝到连接的读缓冲区之后立即归还
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        bool ok = !m_states[fd].closing && conn->feed(m_bufs + bid * BUF_SIZE, res);
+        recycle_buffer(bid);
+        if (!ok) {
+            m_states[fd].closing = true;
+        }
+        finish_op(fd);
+        if (ok) {
+            dispatch(conn);
+        }
+        return;
+    }
+
+    if (res == -ENOBUFS && !m_states[fd].closing) {
+        // 读缓冲区暂时用完了，重新提交
+        finish_op(fd);
+        prep_recv(fd);
+        return;
+    }
+
+    // 被取消的链接recv由writev的完成事件负责重新提交，其余情况（对方关闭或者出错）都关闭连接
+    if (res != -ECANCELED) {
+        m_states[fd].closing = true;
+    }
+    finish_op(fd);
+}
+
+void uring_reactor::handle_write(int fd, int res) {
+    http_conn *conn = m_users + fd;
+    if (res < 0 || m_states[fd].closing) {
+        m_states[fd].closing = true;
+        finish_op(fd);
+        return;
+    }
+
+    http_conn::WRITE_STATUS status = conn->advance_write(res);
+    if (status == http_conn::WRITE_MORE) {
+        // 没写完，链接的recv会被取消，连同writev一起重新提交，写出了数据，发送超时重新计时
+        conn->update_timer(res > 0);
+        prep_write(conn);
+    }
+    else if (status == http_conn::WRITE_DONE_CLOSE) {
+        m_states[fd].closing = true;
+    }
+    else if (conn->has_pending_input()) {
+        // WRITE_DONE_KEEP，读缓冲区中还有没处理的请求，没有链接recv，接着处理
+        finish_op(fd);
+        dispatch(conn);
+        return;
+    }
+    else {
+        // WRITE_DONE_KEEP: 链接在writev后面的recv已经在等待下一个请求
+        conn->update_timer();
+    }
+    finish_op(fd);
+}
+
+void uring_reactor::finish_op(int fd) {
+    conn_state &state = m_states[fd];
+    --state.inflight;
+    if (state.closing && state.inflight <= 0) {
+        state.inflight = 0;
+        state.closing = false;
+        m_users[fd].close_conn();
+    }
+}
+
+void uring_reactor::dispatch(http_conn *conn) {
+    if (!m_pool) {
+        // 没有线程池，直接在事件循环线程中处理，处理结果通过notify回到handle_notify
+        conn->process();
+    }
+    else if (!m_pool->append(conn, sched_getcpu())) {
+        handle_notify(conn, WANT_CLOSE);
+    }
+}
+
+void uring_reactor::notify(http_conn *conn, IO_WANT want) {
+    if (!m_pool) {
+        handle_notify(conn, want);
+        return;
+    }
+
+    // 线程池中的线程不能操作io_uring，交给事件循环线程提交
+    pending_notify n;
+    n.conn = conn;
+    n.want = want;
+    m_pending_locker.lock();
+    m_pending.push_back(n);
+    m_pending_locker.unlock();
+
+    uint64_t one = 1;
+    ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void uring_reactor::handle_pending() {
+    std::vector<pending_notify> pending;
+    m_pending_locker.lock();
+    pending.swap(m_pending);
+    m_pending_locker.unlock();
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        handle_notify(pending[i].conn, pending[i].want);
+    }
+}
+
+void uring_reactor::handle_notify(http_conn *conn, IO_WANT want) {
+    int fd = conn->get_sockfd();
+    if (fd == -1) {
+        return;
+    }
+
+    switch (want) {
+        case WANT_READ :
+            conn->update_timer();
+            prep_recv(fd);
+            break;
+        case WANT_WRITE :
+            conn->update_timer();
+            prep_write(conn);
+            break;
+        default :
+            m_states[fd].closing = true;
+            if (m_states[fd].inflight <= 0) {
+                m_states[fd].inflight = 0;
+                m_states[fd].closing = false;
+                conn->close_conn();
+            }
+            break;
+    }
+}
+
+void uring_reactor::handle_drain() {
+    if (m_lfd != -1) {
+        prep_cancel(URING_DATA(m_lfd, OP_ACCEPT));
+        m_lfd = -1;
+    }
+
+    // 只有一个recv在等待、并且没有读到一半的请求的连接是空闲的，取消recv，recv完成时关闭连接
+    for (int fd = 0; fd < MAX_FD; ++fd) {
+        conn_state &state = m_states[fd];
+        http_conn *conn = m_users + fd;
+        if (state.inflight == 1 && !state.closing && conn->get_sockfd() == fd && conn->idle()) {
+            state.closing = true;
+            prep_cancel(URING_DATA(fd, OP_RECV));
+        }
+    }
+}
+
+void uring_reactor::handle_timeouts() {
+    m_timers->collect(m_expired);
+    for (size_t i = 0; i < m_expired.size(); ++i) {
+        http_conn *conn = m_expired[i];
+        int fd = conn - m_users;
+        conn_state &state = m_states[fd];
+        if (state.closing) {
+            continue;
+        }
+        if (state.inflight <= 0) {
+            // 没有操作在内核中，连接正在被线程池处理，处理完之后如果进入了新的阶段会重新设置定时器，否则下一个tick再检查
+            m_timers->retry(conn);
+            continue;
+        }
+        int kind = m_timers->expired(conn);
+        if (kind < 0) {
+            continue;
+        }
+        // 和handle_drain一样取消未完成的操作，操作完成时关闭连接，没有的那个操作取消失败，直接忽略
+        conn_timers::count(kind);
+        state.closing = true;
+        prep_cancel(URING_DATA(fd, OP_RECV));
+        prep_cancel(URING_DATA(fd, OP_WRITEV));
+    }
+    m_expired.clear();
+}
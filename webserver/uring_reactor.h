@@ -0,0 +1,136 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+#include "threadpool.h"
+#include "http_conn.h"
+#include "event_loop.h"
+#include "conn_timers.h"
+
+/*
+    基于io_uring的事件后端，和reactor一样每个对象一个线程、一个事件循环，但它是完成式的：
+    不等待读写就绪再去调用recv/writev，而是直接把accept、recv、writev提交给内核，再统一收割完成事件
+    - 监听socket上提交一个多次触发（multishot）的accept，一次提交可以接收任意多个连接
+    - recv使用内核提供缓冲区（provided buffer ring），没有数据时不占用连接自己的缓冲区
+    - 保持连接时writev后面链接（IOSQE_IO_LINK）一个recv，写完之后内核直接开始读下一个请求
+    - 所有的提交在一次事件循环的末尾通过一次io_uring_enter批量完成，同时等待新的完成事件
+    每个连接同一时刻只有一组操作在内核中，相当于epoll后端的EPOLLONESHOT
+*/
+class uring_reactor : public event_loop, public io_notifier {
+public:
+    // pool为NULL时，请求的解析和响应的生成直接在事件循环线程中完成
+    uring_reactor(http_conn *users, request_pool<http_conn> *pool);
+    ~uring_reactor();
+
+    void add_listener(int lfd) override; // 监听socket
+    void set_cpu(int cpu) override { m_cpu = cpu; } // 事件循环线程绑定的CPU，-1表示不绑定
+    bool start() override; // 创建线程运行事件循环
+    void run() override; // 在当前线程运行事件循环
+    void stop() override; // 通知事件循环退出
+    void drain() override; // 通知事件循环停止accept并关闭空闲的连接
+    void join() override; // 等待事件循环线程退出
+    int load() const override { return m_load; } // 当前负责的连接数
+
+    // 请求处理完之后由http_conn调用，可能在线程池的线程中
+    void notify(http_conn *conn, IO_WANT want) override;
+
+private:
+    static const unsigned RING_ENTRIES = 4096; // 提交队列的长度
+    static const unsigned BUF_COUNT = 1024; // 提供给内核的读缓冲区个数，必须是2的幂
+    static const unsigned BUF_SIZE = http_conn::READ_BUFFER_SIZE; // 每个读缓冲区的大小
+    static const unsigned BUF_GROUP = 0; // 读缓冲区组号
+
+    // 提交的操作类型，和fd一起编码在user_data中
+    enum OP_TYPE {OP_ACCEPT = 0, OP_RECV, OP_WRITEV, OP_WAKEUP, OP_CANCEL, OP_TIMER};
+
+    // 每个连接在内核中未完成的操作数，以及是否等这些操作完成后关闭连接
+    struct conn_state {
+        int inflight;
+        bool closing;
+    };
+
+    // 其他线程通知过来的连接
+    struct pending_notify {
+        http_conn *conn;
+        IO_WANT want;
+    };
+
+    // 提交队列和完成队列（内核共享内存）
+    int m_ring_fd;
+    void *m_sq_ptr;
+    size_t m_sq_size;
+    void *m_cq_ptr;
+    size_t m_cq_size;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_mask;
+    unsigned *m_sq_array;
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned *m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+    unsigned m_to_submit; // 已经填好但还没提交的sqe个数
+
+    // 提供给内核的读缓冲区
+    struct io_uring_buf_ring *m_buf_ring;
+    size_t m_buf_ring_size;
+    char *m_bufs;
+
+    int m_lfd; // 监听的文件描述符，-1表示不负责accept
+    int m_wakeup_fd; // eventfd，用于其他线程唤醒事件循环
+    uint64_t m_wakeup_val; // eventfd读操作的缓冲区
+    conn_state *m_states; // 以fd为下标的连接状态
+
+    http_conn *m_users; // 所有的客户端信息
+    request_pool<http_conn> *m_pool; // 线程池
+
+    conn_timers *m_timers; // 本事件循环负责的连接的超时
+    std::vector<http_conn *> m_expired; // 一个tick中超时的连接
+
+    std::vector<pending_notify> m_pending; // 线程池通知过来的连接
+    locker m_pending_locker; // 保护m_pending的互斥锁
+
+    std::atomic<int> m_load; // 当前负责的连接数
+    std::atomic<bool> m_stop; // 是否结束事件循环
+    std::atomic<bool> m_drain; // 是否有待处理的drain请求
+    pthread_t m_thread; // 事件循环线程
+    bool m_started;
+    int m_cpu; // 绑定的CPU
+
+    static void *worker(void *arg);
+
+    bool setup_ring();
+    void cleanup();
+    bool setup_buffers();
+    struct io_uring_sqe *get_sqe();
+    int submit_and_wait(unsigned wait_nr);
+    struct io_uring_buf *buf_entry(unsigned i);
+    void recycle_buffer(unsigned bid);
+
+    void prep_accept();
+    void prep_wakeup();
+    void prep_recv(int fd);
+    void prep_write(http_conn *conn);
+    void prep_cancel(uint64_t user_data);
+    void prep_timer();
+
+    void handle_cqe(struct io_uring_cqe *cqe);
+    void handle_accept(int res, unsigned flags);
+    void handle_recv(int fd, int res, unsigned flags);
+    void handle_write(int fd, int res);
+    void handle_pending();
+    void handle_drain(); // 取消多次触发的accept，关闭本事件循环上空闲的连接
+    void handle_timeouts(); // 取消超时连接的操作，操作完成时关闭连接
+    void handle_notify(http_conn *conn, IO_WANT want);
+    void dispatch(http_conn *conn); // 把读到完整数据的连接交给线程池或者直接处理
+    void finish_op(int fd); // 一个操作完成，需要关闭的连接在没有未完成的操作时关闭
+};
+
+#endif